@@ -0,0 +1,395 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arq.h"
+#include "frameparser.h"
+#include "protocol.h"
+
+#define PENDING -1 // sent, timer starts at the next arqSenderDeparted()
+
+// Reads DATALINK_ARQ=<gbn|sr>[:<window>] into config. Unset keeps the
+// stop-and-wait the link always ran. Both ends must be given the same value,
+// which the SET and UA check (see arqConfigOption()). Returns 0 when it
+// cannot be parsed.
+int arqConfigFromEnv(struct arqConfig* config){
+    const char* want = getenv("DATALINK_ARQ");
+    if (want == NULL || *want == '\0')
+        return 1;
+    int mode, window;
+    if (strncmp(want, "gbn", 3) == 0){
+        mode = ARQ_GO_BACK_N;
+        window = SEQ_MODULUS - 1;
+    }
+    else if (strncmp(want, "sr", 2) == 0){
+        mode = ARQ_SELECTIVE;
+        window = SEQ_MODULUS / 2;
+    }
+    else {
+        printf("DATALINK_ARQ must be gbn[:<window>] or sr[:<window>], not %s\n", want);
+        return 0;
+    }
+    const char* rest = want + (mode == ARQ_SELECTIVE ? 2 : 3);
+    char* end = (char*)rest;
+    if (*rest == ':')
+        window = strtol(rest + 1, &end, 10);
+    int most = mode == ARQ_SELECTIVE ? SEQ_MODULUS / 2 : SEQ_MODULUS - 1;
+    if (*end != '\0' || window < 1 || window > most){
+        printf("DATALINK_ARQ window must be 1 to %d for %.*s\n", most, mode == ARQ_SELECTIVE ? 2 : 3, want);
+        return 0;
+    }
+    config->mode = mode;
+    config->window = window;
+    config->modulus = SEQ_MODULUS;
+    return 1;
+}
+
+const char* arqModeName(const struct arqConfig* config){
+    if (config->mode == ARQ_SELECTIVE)
+        return "selective repeat";
+    return config->window == 1 ? "stop-and-wait" : "go-back-n";
+}
+
+// The ARQ as the SET and UA carry it: the window, with ARQ_OPTION_SELECTIVE
+// for Selective Repeat. 0 stands for DATALINK_ARQ unset, the built-in
+// stop-and-wait with its own modulus, which goes without the byte.
+unsigned char arqConfigOption(const struct arqConfig* config){
+    if (config->modulus != SEQ_MODULUS)
+        return 0;
+    return config->window | (config->mode == ARQ_SELECTIVE ? ARQ_OPTION_SELECTIVE : 0);
+}
+
+// Writes option out as the DATALINK_ARQ value that gives it
+void arqOptionFormat(char* buf, int size, unsigned char option){
+    if (option == 0)
+        snprintf(buf, size, "unset");
+    else
+        snprintf(buf, size, "%s:%d", (option & ARQ_OPTION_SELECTIVE) ? "sr" : "gbn", option & ~ARQ_OPTION_SELECTIVE);
+}
+
+void arqSenderInit(struct arqSender* s, const struct arqConfig* config){
+    memset(s, 0, sizeof(*s));
+    s->config = *config;
+    s->timeout = config->timeout;
+    s->credit = config->window;
+}
+
+// Frames from base the sender may have on the wire: the window, or less when
+// the receiver said so
+static int allowed(const struct arqSender* s){
+    return s->credit > 0 ? s->credit : s->probe;
+}
+
+int arqSenderWindowOpen(const struct arqSender* s){
+    return !s->failed && s->next < s->base + allowed(s);
+}
+
+// Nothing in flight and nothing waiting to go again
+int arqSenderIdle(const struct arqSender* s){
+    return s->base == s->highest;
+}
+
+// The frame that should go on the wire next, or -1 when the window is
+// closed and nothing is due again. Under Selective Repeat frames marked for
+// resending come first, oldest first.
+long long arqSenderPick(const struct arqSender* s){
+    if (s->failed)
+        return -1;
+    if (s->config.mode == ARQ_SELECTIVE)
+        for (long long seq = s->base; seq < s->next && seq < s->base + allowed(s); seq++)
+            if (s->resend[seq % ARQ_MAX_WINDOW])
+                return seq;
+    return arqSenderWindowOpen(s) ? s->next : -1;
+}
+
+// The caller has just handed frame seq, as returned by arqSenderPick(), to
+// the port
+void arqSenderSent(struct arqSender* s, long long seq){
+    s->stats.sent++;
+    if (seq < s->highest)
+        s->stats.retransmitted++;
+    if (seq == s->next)
+        s->next++;
+    if (s->next > s->highest)
+        s->highest = s->next;
+    s->resend[seq % ARQ_MAX_WINDOW] = 0;
+    s->deadlines[seq % ARQ_MAX_WINDOW] = PENDING;
+    s->departing++;
+    s->probe = 0;
+}
+
+// Earliest running timer of the window, for the caller to wait on
+static void nextDeadline(struct arqSender* s){
+    s->deadline = 0;
+    for (long long seq = s->base; seq < s->highest; seq++){
+        long long d = s->deadlines[seq % ARQ_MAX_WINDOW];
+        if (d > 0 && (s->deadline == 0 || d < s->deadline))
+            s->deadline = d;
+    }
+}
+
+// The frames sent since the last call have left the wire at now, so their
+// timers start. Go-Back-N has a single timer for the oldest frame, which
+// only starts here when it was stopped.
+void arqSenderDeparted(struct arqSender* s, long long now){
+    if (s->departing == 0)
+        return;
+    s->departing = 0;
+    if (s->config.mode != ARQ_SELECTIVE){
+        if (s->deadline == 0)
+            s->deadline = now + s->timeout;
+        return;
+    }
+    for (long long seq = s->base; seq < s->highest; seq++)
+        if (s->deadlines[seq % ARQ_MAX_WINDOW] == PENDING)
+            s->deadlines[seq % ARQ_MAX_WINDOW] = now + s->timeout;
+    nextDeadline(s);
+}
+
+// Acknowledges everything before nr. Returns how many frames that freed, 0
+// for a stale or nonsensical nr.
+static int acknowledge(struct arqSender* s, int nr, long long now){
+    int m = s->config.modulus;
+    long long distance = ((nr - s->base) % m + m) % m;
+    if (distance == 0 || distance > s->highest - s->base)
+        return 0;
+    for (long long seq = s->base; seq < s->base + distance; seq++){
+        s->resend[seq % ARQ_MAX_WINDOW] = 0;
+        s->deadlines[seq % ARQ_MAX_WINDOW] = 0;
+    }
+    s->base += distance;
+    if (s->next < s->base)
+        s->next = s->base;
+    s->stats.acked += distance;
+    s->retries = 0;
+    s->timeout = s->config.timeout;
+    if (s->config.mode == ARQ_SELECTIVE)
+        nextDeadline(s);
+    else
+        s->deadline = s->base == s->highest ? 0 : now + s->timeout;
+    return distance;
+}
+
+int arqSenderAck(struct arqSender* s, int nr, long long now){
+    return acknowledge(s, nr, now);
+}
+
+// Everything in flight from base goes again, by rewinding next (Go-Back-N)
+// or by marking each frame (Selective Repeat, where next only ever grows)
+static void goBack(struct arqSender* s){
+    if (s->config.mode != ARQ_SELECTIVE){
+        s->next = s->base;
+        return;
+    }
+    for (long long seq = s->base; seq < s->next; seq++){
+        s->resend[seq % ARQ_MAX_WINDOW] = 1;
+        s->deadlines[seq % ARQ_MAX_WINDOW] = 0;
+    }
+    nextDeadline(s);
+}
+
+// REJ(nr) acknowledges up to nr and sends everything from nr again
+int arqSenderReject(struct arqSender* s, int nr, long long now){
+    int freed = acknowledge(s, nr, now);
+    s->stats.rejects++;
+    goBack(s);
+    return freed;
+}
+
+// Everything in flight goes again at once, without anything acknowledged or
+// counted as a reject, for frames the receiver may never have looked at
+void arqSenderRewind(struct arqSender* s){
+    goBack(s);
+}
+
+// SREJ(nr) acknowledges up to nr and sends only nr again. A Go-Back-N sender
+// takes it as a REJ.
+int arqSenderSelectiveReject(struct arqSender* s, int nr, long long now){
+    if (s->config.mode != ARQ_SELECTIVE)
+        return arqSenderReject(s, nr, now);
+    int freed = acknowledge(s, nr, now);
+    s->stats.rejects++;
+    if (s->base < s->next && s->base % s->config.modulus == nr){
+        s->resend[s->base % ARQ_MAX_WINDOW] = 1;
+        s->deadlines[s->base % ARQ_MAX_WINDOW] = 0;
+        nextDeadline(s);
+    }
+    return freed;
+}
+
+// Credit from an RR (the window when it carried none) or RNR (0). A busy
+// receiver drops what it cannot take, so on RNR everything in flight is
+// due again once credit returns, and until then the timer only probes.
+void arqSenderCredit(struct arqSender* s, int credit, long long now){
+    int was = s->credit;
+    s->credit = credit < s->config.window ? credit : s->config.window;
+    // Whatever it says, the receiver is alive
+    s->retries = 0;
+    s->timeout = s->config.timeout;
+    if (s->credit == 0){
+        goBack(s);
+        s->probe = 0;
+        s->deadline = now + s->timeout;
+    }
+    else if (was == 0){
+        if (s->config.mode == ARQ_SELECTIVE)
+            nextDeadline(s);
+        else if (s->next == s->base)
+            s->deadline = 0;
+    }
+}
+
+// Returns 1 when a timer expired: Go-Back-N goes back to base, Selective
+// Repeat marks the frames whose own timers ran out. Only the oldest frame's
+// timer counts towards giving up, so a window of timers running out one
+// after the other is a single retry. Without credit the timer lets one frame
+// go as a probe, and counts only when the last probe got no answer at all.
+int arqSenderTick(struct arqSender* s, long long now){
+    if (s->deadline == 0 || now < s->deadline)
+        return 0;
+    s->stats.timeouts++;
+    if (s->credit == 0){
+        if (++s->retries > s->config.maxRetries){
+            s->failed = 1;
+            s->deadline = 0;
+            return 1;
+        }
+        goBack(s);
+        s->probe = 1;
+        s->deadline = now + s->timeout;
+        return 1;
+    }
+    long long oldest = s->deadlines[s->base % ARQ_MAX_WINDOW];
+    int retry = s->config.mode != ARQ_SELECTIVE || (oldest > 0 && oldest <= now);
+    if (retry && ++s->retries > s->config.maxRetries){
+        s->failed = 1;
+        s->deadline = 0;
+        return 1;
+    }
+    if (retry && s->config.policy == ARQ_TIMEOUT_BACKOFF){
+        s->timeout *= 2;
+        if (s->config.maxTimeout > 0 && s->timeout > s->config.maxTimeout)
+            s->timeout = s->config.maxTimeout;
+    }
+    if (s->config.mode != ARQ_SELECTIVE){
+        s->next = s->base;
+        s->deadline = now + s->timeout;
+        return 1;
+    }
+    for (long long seq = s->base; seq < s->highest; seq++){
+        long long d = s->deadlines[seq % ARQ_MAX_WINDOW];
+        if (d > 0 && d <= now){
+            s->resend[seq % ARQ_MAX_WINDOW] = 1;
+            s->deadlines[seq % ARQ_MAX_WINDOW] = 0;
+        }
+    }
+    nextDeadline(s);
+    return 1;
+}
+
+void arqReceiverInit(struct arqReceiver* r, const struct arqConfig* config){
+    memset(r, 0, sizeof(*r));
+    r->mode = config->mode;
+    r->modulus = config->modulus;
+    r->window = config->window;
+}
+
+// Reorder buffer slot of an absolute frame number
+int arqReceiverSlot(const struct arqReceiver* r, long long frame){
+    return frame % r->window;
+}
+
+// N(S) values, as a bit set, of the I-frames arqReceive() would not deliver
+// or hold whatever their BCC2: everything but expected under Go-Back-N, and
+// under Selective Repeat whatever is outside the window or already held. The
+// parser can pass over their data (struct frameParser skip).
+int arqReceiverUnwanted(const struct arqReceiver* r){
+    int m = r->modulus;
+    int unwanted = 0;
+    for (int distance = 1; distance < m; distance++){
+        long long frame = r->expected + distance;
+        if (r->mode != ARQ_SELECTIVE || distance >= r->window || r->held[arqReceiverSlot(r, frame)])
+            unwanted |= 1 << frame % m;
+    }
+    return unwanted;
+}
+
+// Selective Repeat. Good frames inside the window after a gap are held
+// (ARQ_BUFFER, the caller keeps the payload in slot arqReceiverSlot(frame)).
+// The expected frame is delivered together with the run of held frames after
+// it, the last r->released of which come from the reorder buffer. While a gap
+// remains the reply is SREJ for its first frame, sent once per gap unless the
+// frame arrives damaged again.
+static int receiveSelective(struct arqReceiver* r, int seq, int ok, int* reply, int* replySeq){
+    int m = r->modulus;
+    int distance = ((seq - r->expected) % m + m) % m;
+    *replySeq = r->expected % m;
+    *reply = FRAME_NONE;
+    r->released = 0;
+    if (distance >= r->window){
+        *reply = FRAME_RR;
+        return ARQ_DUPLICATE;
+    }
+    r->frame = r->expected + distance;
+    if (r->frame >= r->seen)
+        r->seen = r->frame + 1;
+    if (distance == 0 && !ok){
+        *reply = FRAME_SREJ;
+        r->rejected = 1;
+        return ARQ_REJECT;
+    }
+    if (distance > 0){
+        int action = ARQ_DISCARD;
+        if (ok && !r->held[arqReceiverSlot(r, r->frame)]){
+            r->held[arqReceiverSlot(r, r->frame)] = 1;
+            action = ARQ_BUFFER;
+        }
+        if (!r->rejected){
+            *reply = FRAME_SREJ;
+            r->rejected = 1;
+        }
+        return action;
+    }
+    r->expected++;
+    while (r->held[arqReceiverSlot(r, r->expected)] && r->expected < r->seen){
+        r->held[arqReceiverSlot(r, r->expected)] = 0;
+        r->expected++;
+        r->released++;
+    }
+    r->rejected = r->expected < r->seen;
+    *reply = r->rejected ? FRAME_SREJ : FRAME_RR;
+    *replySeq = r->expected % m;
+    return ARQ_DELIVER;
+}
+
+// Decides what to do with I-frame seq and which reply goes back. Frames
+// behind expected are duplicates and get RR(expected); frames ahead of it
+// mean a gap, which gets one REJ. A bad BCC2 on the expected frame is a REJ.
+int arqReceive(struct arqReceiver* r, int seq, int ok, int* reply, int* replySeq){
+    if (r->mode == ARQ_SELECTIVE)
+        return receiveSelective(r, seq, ok, reply, replySeq);
+    int m = r->modulus;
+    int distance = ((seq - r->expected) % m + m) % m;
+    *replySeq = r->expected % m;
+    r->released = 0;
+    if (distance != 0){
+        if (distance < r->window){
+            *reply = r->rejected ? FRAME_NONE : FRAME_REJ;
+            r->rejected = 1;
+            return ARQ_DISCARD;
+        }
+        *reply = FRAME_RR;
+        return ARQ_DUPLICATE;
+    }
+    if (!ok){
+        *reply = FRAME_REJ;
+        r->rejected = 1;
+        return ARQ_REJECT;
+    }
+    r->frame = r->expected;
+    r->expected++;
+    r->rejected = 0;
+    *reply = FRAME_RR;
+    *replySeq = r->expected % m;
+    return ARQ_DELIVER;
+}
@@ -0,0 +1,110 @@
+// Link state machine for the data phase, without any I/O
+//
+// Two modes share the window, the cumulative RR and the timer:
+//
+//   Go-Back-N         REJ and timeouts go back to the oldest unacknowledged
+//                     frame and resend everything from there. A window of 1
+//                     with modulus 2 is the stop-and-wait the serial link runs.
+//   Selective Repeat  every frame has its own timer and only frames that timed
+//                     out or were named by an SREJ go again. The receiver
+//                     holds good frames that arrive after a gap in a reorder
+//                     buffer and delivers them once the gap is filled.
+//
+// SREJ(nr) always names the receiver's oldest missing frame, so like REJ it
+// also acknowledges everything before nr.
+//
+// The receiver can also narrow the window with a credit, down to 0 (RNR).
+// While it is 0 nothing is sent and the timer only probes the receiver with
+// the oldest frame; a probe answered with RNR again is not a retry, so a
+// receiver that is slow but alive never makes the sender give up.
+//
+// Time is whatever clock the caller
+// passes in (ns), so the same code runs on the real port and under the
+// simulator's virtual clock.
+
+#ifndef ARQ_H
+#define ARQ_H
+
+#define ARQ_MAX_WINDOW 64
+
+enum { ARQ_TIMEOUT_FIXED, ARQ_TIMEOUT_BACKOFF };
+enum { ARQ_GO_BACK_N, ARQ_SELECTIVE };
+
+#define ARQ_OPTION_SELECTIVE 0x80 // in the ARQ option byte, above the window
+
+struct arqConfig {
+    int window;
+    int modulus;         // sequence numbers on the wire, window < modulus
+                         // (window <= modulus / 2 for Selective Repeat)
+    long long timeout;   // ns before an unacknowledged frame is sent again
+    long long maxTimeout;
+    int policy;          // ARQ_TIMEOUT_FIXED or ARQ_TIMEOUT_BACKOFF (doubling)
+    int maxRetries;      // consecutive timeouts before the link is given up
+    int mode;            // ARQ_GO_BACK_N or ARQ_SELECTIVE
+};
+
+struct arqStats {
+    long long sent;
+    long long retransmitted;
+    long long acked;
+    long long rejects;
+    long long timeouts;
+};
+
+// Sequence numbers are absolute frame counts; only seq % modulus goes on the
+// wire. Per-frame state is indexed by seq % ARQ_MAX_WINDOW.
+struct arqSender {
+    struct arqConfig config;
+    long long base;     // oldest frame not acknowledged
+    long long next;     // next new frame to put on the wire
+    long long highest;  // one past the highest frame ever sent
+    long long deadline; // earliest retransmission timer, 0 when all are stopped
+    long long timeout;  // current timeout, grows under backoff
+    int retries;
+    int failed;
+    int departing;      // frames sent since the last arqSenderDeparted()
+    int credit;         // frames from base the receiver can take, at most the window
+    int probe;          // credit is 0 and the timer asked for one frame anyway
+    long long deadlines[ARQ_MAX_WINDOW]; // Selective Repeat: timer of each frame
+    unsigned char resend[ARQ_MAX_WINDOW]; // Selective Repeat: frame goes again
+    struct arqStats stats;
+};
+
+enum { ARQ_DELIVER, ARQ_DUPLICATE, ARQ_REJECT, ARQ_DISCARD, ARQ_BUFFER };
+
+struct arqReceiver {
+    int mode;
+    int modulus;
+    int window;
+    long long expected; // next frame to deliver
+    int rejected;       // REJ or SREJ already sent for expected
+    long long seen;     // Selective Repeat: one past the highest frame that arrived
+    long long frame;    // absolute number of the frame arqReceive() last took
+    int released;       // buffered frames delivered along with it, up to expected
+    unsigned char held[ARQ_MAX_WINDOW]; // reorder buffer slots in use
+};
+
+int arqConfigFromEnv(struct arqConfig* config);
+const char* arqModeName(const struct arqConfig* config);
+unsigned char arqConfigOption(const struct arqConfig* config);
+void arqOptionFormat(char* buf, int size, unsigned char option);
+
+void arqSenderInit(struct arqSender* s, const struct arqConfig* config);
+int arqSenderWindowOpen(const struct arqSender* s);
+long long arqSenderPick(const struct arqSender* s);
+void arqSenderSent(struct arqSender* s, long long seq);
+void arqSenderDeparted(struct arqSender* s, long long now);
+int arqSenderAck(struct arqSender* s, int nr, long long now);
+int arqSenderReject(struct arqSender* s, int nr, long long now);
+int arqSenderSelectiveReject(struct arqSender* s, int nr, long long now);
+void arqSenderRewind(struct arqSender* s);
+void arqSenderCredit(struct arqSender* s, int credit, long long now);
+int arqSenderTick(struct arqSender* s, long long now);
+int arqSenderIdle(const struct arqSender* s);
+
+void arqReceiverInit(struct arqReceiver* r, const struct arqConfig* config);
+int arqReceive(struct arqReceiver* r, int seq, int ok, int* reply, int* replySeq);
+int arqReceiverSlot(const struct arqReceiver* r, long long frame);
+int arqReceiverUnwanted(const struct arqReceiver* r);
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+# One transfer against two at once over a paced virtual cable
+#
+# Sends a file from write_datalink to read_datalink, then the same file
+# while read_datalink sends one of the same size back (--send / --receive).
+# On a full-duplex line the second run should take about as long as the
+# first, with most RR frames replaced by the N(R) in the I-frames.
+#
+# Usage: ./bench_duplex.sh [size] [arq]   e.g. ./bench_duplex.sh 100K sr
+
+SIZE=${1:-100K}
+ARQ=${2:-gbn}
+BAUD=115200
+DIR=$(mktemp -d)
+trap 'kill $CABLE $READER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/cable" cable.c || exit 1
+gcc -O2 -o "$DIR/write_datalink" write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+gcc -O2 -o "$DIR/read_datalink" read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+
+head -c "$SIZE" /dev/urandom > "$DIR/forward"
+head -c "$SIZE" /dev/urandom > "$DIR/reverse"
+
+"$DIR/cable" "$DIR/ttyA" "$DIR/ttyB" $BAUD > /dev/null &
+CABLE=$!
+sleep 1
+
+# Pulls one frame counter out of the final metrics line
+counter() {
+    tail -n 1 "$1" | sed -n "s/.*\"$2\":\([0-9]*\).*/\1/p"
+}
+
+run() {
+    rm -f "$DIR/output" "$DIR/back"
+    DATALINK_ARQ=$ARQ "$DIR/read_datalink" "$DIR/ttyB" "$DIR/output" $1 > /dev/null 2> "$DIR/reader.err" &
+    READER=$!
+    sleep 1
+    START=$(date +%s.%N)
+    DATALINK_ARQ=$ARQ "$DIR/write_datalink" "$DIR/ttyA" "$DIR/forward" $2 > /dev/null 2> "$DIR/writer.err"
+    END=$(date +%s.%N)
+    wait $READER
+    cmp -s "$DIR/forward" "$DIR/output" || echo "output differs from input"
+    [ -z "$1" ] || cmp -s "$DIR/reverse" "$DIR/back" || echo "reverse output differs from its input"
+    printf "%-8s %9.2f s %10s %12s\n" "$3" "$(awk "BEGIN { print $END - $START }")" \
+        "$(( $(counter "$DIR/writer.err" sent) + $(counter "$DIR/reader.err" sent) ))" \
+        "$(( $(counter "$DIR/writer.err" piggybacked) + $(counter "$DIR/reader.err" piggybacked) ))"
+}
+
+echo "$(stat -c %s "$DIR/forward") bytes each way at $BAUD baud, DATALINK_ARQ=$ARQ"
+echo "run           time     frames  piggybacked"
+run "" "" one-way
+run "--send $DIR/reverse" "--receive $DIR/back" duplex
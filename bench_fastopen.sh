@@ -0,0 +1,51 @@
+#!/bin/sh
+# Small transfers with and without fast open over a slow, distant line
+#
+# Sends the same small file several times from write_datalink to
+# read_datalink over a paced virtual cable with a one-way delay, first with
+# the usual SET / UA exchange and then with DATALINK_FASTOPEN=1, where the
+# first frames follow the SET at once. Fast open should save one round trip
+# per transfer, twice the delay.
+#
+# Usage: ./bench_fastopen.sh [size] [delay ms] [runs] [arq]   e.g. ./bench_fastopen.sh 1K 50 5 gbn
+
+SIZE=${1:-1K}
+DELAY=${2:-50}
+RUNS=${3:-5}
+ARQ=${4:-gbn}
+BAUD=115200
+DIR=$(mktemp -d)
+trap 'kill $CABLE $READER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/cable" cable.c || exit 1
+gcc -O2 -o "$DIR/write_datalink" write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+gcc -O2 -o "$DIR/read_datalink" read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+
+head -c "$SIZE" /dev/urandom > "$DIR/input"
+
+"$DIR/cable" "$DIR/ttyA" "$DIR/ttyB" $BAUD $DELAY > /dev/null &
+CABLE=$!
+sleep 1
+
+# Average time of RUNS transfers, with DATALINK_FASTOPEN set to $1
+run() {
+    TOTAL=0
+    for i in $(seq "$RUNS"); do
+        rm -f "$DIR/output"
+        DATALINK_ARQ=$ARQ "$DIR/read_datalink" "$DIR/ttyB" "$DIR/output" > /dev/null 2>&1 &
+        READER=$!
+        sleep 0.5
+        START=$(date +%s.%N)
+        DATALINK_ARQ=$ARQ DATALINK_FASTOPEN=$1 "$DIR/write_datalink" "$DIR/ttyA" "$DIR/input" > /dev/null 2>&1
+        END=$(date +%s.%N)
+        wait $READER
+        cmp -s "$DIR/input" "$DIR/output" || echo "output differs from input"
+        TOTAL=$(awk "BEGIN { print $TOTAL + $END - $START }")
+    done
+    printf "%-10s %9.1f ms\n" "$2" "$(awk "BEGIN { print $TOTAL / $RUNS * 1000 }")"
+}
+
+echo "$(stat -c %s "$DIR/input") bytes, $RUNS runs at $BAUD baud with ${DELAY} ms each way, DATALINK_ARQ=$ARQ"
+echo "open        average"
+run 0 SET/UA
+run 1 fast
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Reply jitter with and without the real-time mode
+#
+# Sends the same file twice through a paced virtual cable while LOAD busy
+# loops compete for the CPUs: once as is, once with DATALINK_RT set on both
+# ends. Prints the receiver's delay from reading a frame to writing its
+# reply, and the sender's whole round trip from frame to RR.
+#
+# Usage: ./bench_jitter.sh [size] [cpu[:priority]] [load]   e.g. ./bench_jitter.sh 200K 1:50 4
+
+SIZE=${1:-200K}
+RT=${2:-0}
+LOAD=${3:-$(nproc)}
+BAUD=115200
+DIR=$(mktemp -d)
+trap 'kill $CABLE $READER $HOGS 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/cable" cable.c || exit 1
+gcc -O2 -o "$DIR/write_datalink" write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+gcc -O2 -o "$DIR/read_datalink" read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+
+head -c "$SIZE" /dev/urandom > "$DIR/input"
+
+"$DIR/cable" "$DIR/ttyA" "$DIR/ttyB" $BAUD > /dev/null &
+CABLE=$!
+sleep 1
+
+HOGS=""
+for i in $(seq "$LOAD"); do
+    sh -c 'while :; do :; done' &
+    HOGS="$HOGS $!"
+done
+
+# Pulls one histogram out of the final metrics line as "p50 p99 p999" in us
+percentiles() {
+    tail -n 1 "$1" | sed -n "s/.*\"$2\":{[^}]*\"p50\":\([0-9]*\),[^}]*\"p99\":\([0-9]*\),\"p999\":\([0-9]*\).*/\1 \2 \3/p" |
+        awk '{ printf "%10.1f %10.1f %10.1f", $1 / 1000, $2 / 1000, $3 / 1000 }'
+}
+
+run() {
+    DATALINK_RT=$1 "$DIR/read_datalink" "$DIR/ttyB" "$DIR/output" > /dev/null 2> "$DIR/reader.err" &
+    READER=$!
+    sleep 1
+    DATALINK_RT=$1 "$DIR/write_datalink" "$DIR/ttyA" "$DIR/input" > /dev/null 2> "$DIR/writer.err"
+    wait $READER
+    cmp -s "$DIR/input" "$DIR/output" || echo "output differs from input"
+    printf "%-12s  reply %s    ack %s\n" "${1:-off}" \
+        "$(percentiles "$DIR/reader.err" arrival_to_reply)" "$(percentiles "$DIR/writer.err" send_to_ack)"
+}
+
+echo "$(stat -c %s "$DIR/input") bytes at $BAUD baud, $LOAD busy loops"
+echo "mode                     p50 us     p99 us    p999 us          p50 us     p99 us    p999 us"
+run ""
+run "$RT"
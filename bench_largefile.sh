@@ -0,0 +1,54 @@
+#!/bin/sh
+# Large-file benchmark over a virtual cable
+#
+# Sends a sparse file of SIZE bytes (3 GiB by default) through cable and
+# samples the resident memory of both endpoints once a second. Flat RSS and
+# a steady rate show the transfer streams in constant memory.
+#
+# Usage: ./bench_largefile.sh [size]     e.g. ./bench_largefile.sh 5G
+
+SIZE=${1:-3G}
+DIR=$(mktemp -d)
+trap 'kill $CABLE $READER $WRITER 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/cable" cable.c || exit 1
+gcc -O2 -o "$DIR/write_datalink" write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+gcc -O2 -o "$DIR/read_datalink" read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+
+truncate -s "$SIZE" "$DIR/input"
+BYTES=$(stat -c %s "$DIR/input")
+
+"$DIR/cable" "$DIR/ttyA" "$DIR/ttyB" > /dev/null &
+CABLE=$!
+sleep 1
+
+"$DIR/read_datalink" "$DIR/ttyB" /dev/null > /dev/null 2> "$DIR/reader.err" &
+READER=$!
+sleep 1
+START=$(date +%s.%N)
+"$DIR/write_datalink" "$DIR/ttyA" "$DIR/input" > /dev/null 2> "$DIR/writer.err" &
+WRITER=$!
+
+rss() {
+    awk '/VmRSS/ { print $2 }' "/proc/$1/status" 2>/dev/null || echo 0
+}
+
+echo "size $BYTES bytes"
+echo "elapsed_s  writer_rss_kb  reader_rss_kb"
+MAXW=0; MAXR=0
+while kill -0 $WRITER 2>/dev/null; do
+    W=$(rss $WRITER); R=$(rss $READER)
+    [ "${W:-0}" -gt $MAXW ] && MAXW=$W
+    [ "${R:-0}" -gt $MAXR ] && MAXR=$R
+    NOW=$(date +%s.%N)
+    printf "%9.0f  %13s  %13s\n" "$(awk "BEGIN { print $NOW - $START }")" "$W" "$R"
+    sleep 1
+done
+END=$(date +%s.%N)
+wait $WRITER
+STATUS=$?
+
+echo "writer exit $STATUS"
+echo "peak rss: writer $MAXW kB, reader $MAXR kB"
+awk "BEGIN { s = $END - $START; printf \"throughput: %.2f MiB/s over %.1f s\n\", $BYTES / s / 1048576, s }"
+cat "$DIR/writer.err" "$DIR/reader.err"
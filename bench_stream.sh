@@ -0,0 +1,57 @@
+#!/bin/sh
+# Streaming output latency against system calls
+#
+# Sends the same file through a paced virtual cable into read_datalink
+# writing to "-", piped into cat, under several flush policies. Prints how
+# long output waited in the sink before its write (or vmsplice) and the
+# receiver's system calls. Batching only saves calls when frames arrive
+# faster than the flush interval, so BAUD (115200 by default, 0 unpaced)
+# sets the cable's rate.
+#
+# Usage: [BAUD=n] ./bench_stream.sh [size] [flush ms...]     e.g. BAUD=0 ./bench_stream.sh 1M 0 2 10
+
+SIZE=${1:-200K}
+[ $# -gt 0 ] && shift
+FLUSHES=${*:-0 2 10}
+BAUD=${BAUD:-115200}
+DIR=$(mktemp -d)
+trap 'kill $CABLE 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -O2 -o "$DIR/cable" cable.c || exit 1
+gcc -O2 -o "$DIR/write_datalink" write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+gcc -O2 -o "$DIR/read_datalink" read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread || exit 1
+
+head -c "$SIZE" /dev/urandom > "$DIR/input"
+
+"$DIR/cable" "$DIR/ttyA" "$DIR/ttyB" $BAUD > /dev/null &
+CABLE=$!
+sleep 1
+
+# Pulls one histogram out of the metrics line as "p50 p99 max" in us
+percentiles() {
+    grep '"program"' "$1" | tail -n 1 |
+        sed -n "s/.*\"$2\":{[^}]*\"p50\":\([0-9]*\),[^}]*\"p99\":\([0-9]*\),\"p999\":[0-9]*,\"max\":\([0-9]*\).*/\1 \2 \3/p" |
+        awk '{ printf "%10.1f %10.1f %10.1f", $1 / 1000, $2 / 1000, $3 / 1000 }'
+}
+
+syscalls() {
+    grep '"program"' "$1" | tail -n 1 | sed -n 's/.*"syscalls":{"total":\([0-9]*\).*/\1/p'
+}
+
+run() {
+    ( DATALINK_ARQ=gbn DATALINK_FLUSH=$1 DATALINK_VMSPLICE=$2 "$DIR/read_datalink" "$DIR/ttyB" - 2> "$DIR/reader.err" | cat > "$DIR/output" ) &
+    READER=$!
+    sleep 1
+    DATALINK_ARQ=gbn "$DIR/write_datalink" "$DIR/ttyA" "$DIR/input" > /dev/null 2> "$DIR/writer.err"
+    wait $READER
+    cmp -s "$DIR/input" "$DIR/output" || echo "output differs from input"
+    printf "%8s %8s  %s %10s\n" "$1" "$2" "$(percentiles "$DIR/reader.err" queued_to_written)" "$(syscalls "$DIR/reader.err")"
+}
+
+if [ "$BAUD" = 0 ]; then PACE="unpaced"; else PACE="at $BAUD baud"; fi
+echo "$(stat -c %s "$DIR/input") bytes $PACE, go-back-n"
+echo "flush_ms vmsplice      p50 us     p99 us     max us   syscalls"
+for f in $FLUSHES; do
+    run "$f" 0
+    run "$f" 1
+done
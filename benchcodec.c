@@ -0,0 +1,323 @@
+// Microbenchmarks for the per-frame codec functions
+//
+// Usage: benchcodec [cpu] [samples]
+// Measures frameStuff()/frameClose(), createInformationFrame(), the parser on
+// I-frames (parse_i, the variant built for the framing, and parse_generic,
+// the runtime-parameterized parser), on I-frames it passes over as
+// duplicates and on supervision frames, frameSupervision() and
+// frameInfoHeader()
+// for payloads of 16 to 4096 bytes that are uniformly random (escape_pct -1)
+// or hold 0 to 100% FLAG bytes, under byte stuffing and under COBS. Payloads
+// larger than a frame are split over as many frames as the sender would use,
+// and wire_ratio is the bytes that take on the wire per payload byte.
+//
+// The process is pinned to one CPU (0 by default). Every case is warmed up,
+// then timed as samples (21 by default) of about 2 ms each. Payloads come
+// from a fixed seed, so CSV output from two commits can be diffed directly.
+// Cycles are TSC reference cycles on x86; elsewhere bytes_per_cycle is 0.
+//
+// The encode_workers_<n> cases cut a 256 KiB stream into DATA frames as the
+// sender does and encode them inline (0) or on 1 to 8 encoder threads, which
+// may run on any CPU; frames is then the frames per pass, and ns_per_frame
+// is wall time, so it only falls with the workers if there are CPUs for them.
+//
+// Build: gcc -O2 -o benchcodec benchcodec.c framepool.c frameparser.c metrics.c trace.c ioengine.c encoder.c realtime.c -pthread
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define cycles() __rdtsc()
+#else
+#define cycles() 0ULL
+#endif
+
+#include "encoder.h"
+#include "framepool.h"
+#include "frameparser.h"
+#include "metrics.h"
+#include "packet.h"
+#include "protocol.h"
+
+#define MAX_PAYLOAD 4096
+#define MAX_SAMPLES 101
+#define SAMPLE_NS 2000000LL
+#define WARMUP_NS 50000000LL
+#define ENCODE_BYTES (1 << 18)
+
+int payloadSizes[] = { 16, 64, 256, 1024, 4096 };
+int escapePercents[] = { -1, 0, 25, 50, 75, 100 };
+int framings[] = { FRAMING_HDLC, FRAMING_COBS };
+int workerCounts[] = { 0, 1, 2, 4, 8 };
+
+unsigned char payload[MAX_PAYLOAD];
+int payloadSize;
+unsigned char wire[MAX_PAYLOAD * 3];
+int wireSize;
+struct frame out;
+unsigned char parsed[FRAME_SIZE];
+struct frameParser parser;
+unsigned char stream[ENCODE_BYTES];
+long streamWire;
+struct encoder encoder;
+
+// Runs one pass of the benchmark and returns the frames it handled
+typedef long (*benchFunction)();
+
+long benchStuff(){
+    long frames = 0;
+    int pos = 0;
+    do {
+        int n = 4;
+        unsigned char bcc = 0x00;
+        frameInfoHeader(out.data, frames & 1);
+        pos += frameStuff(&out, &n, payload + pos, payloadSize - pos, &bcc);
+        frameClose(&out, n, bcc);
+        frames++;
+    } while (pos < payloadSize);
+    return frames;
+}
+
+long benchCreate(){
+    long frames = 0;
+    int pos = 0;
+    do {
+        pos += createInformationFrame(&out, payload + pos, payloadSize - pos);
+        frames++;
+    } while (pos < payloadSize);
+    return frames;
+}
+
+long benchParse(){
+    struct frameInfo info;
+    long frames = 0;
+    int pos = 0;
+    while (pos < wireSize){
+        pos += parserFeed(&parser, wire + pos, wireSize - pos, &info);
+        if (info.type != FRAME_NONE)
+            frames++;
+    }
+    return frames;
+}
+
+// parse_i through the runtime-parameterized parser the variants replace
+long benchParseGeneric(){
+    struct frameInfo info;
+    long frames = 0;
+    int pos = 0;
+    while (pos < wireSize){
+        pos += parserFeedGeneric(&parser, wire + pos, wireSize - pos, &info);
+        if (info.type != FRAME_NONE)
+            frames++;
+    }
+    return frames;
+}
+
+// Cuts the stream into DATA packets and encodes them, inline or on the
+// encoder's threads, collecting the frames back in order
+long benchEncode(){
+    unsigned char packet[FRAME_SIZE];
+    struct frame* f;
+    long frames = 0;
+    int pos = 0;
+    streamWire = 0;
+    while (pos < ENCODE_BYTES || encoderPending(&encoder) > 0){
+        while (pos < ENCODE_BYTES && (encoder.workers == 0 || encoderRoom(&encoder) > 0)){
+            int n;
+            int length = packetData(packet, stream + pos, ENCODE_BYTES - pos, &n);
+            pos += n;
+            f = frameAcquire();
+            if (encoder.workers > 0){
+                encoderSubmit(&encoder, f, packet, length);
+                continue;
+            }
+            encodePacket(f, packet, length);
+            streamWire += f->length;
+            frameRelease(f);
+            frames++;
+        }
+        while ((f = encoderCollect(&encoder, pos == ENCODE_BYTES || encoderRoom(&encoder) == 0)) != NULL){
+            streamWire += f->length;
+            frameRelease(f);
+            frames++;
+        }
+    }
+    return frames;
+}
+
+long benchSupervision(){
+    for (int i = 0; i < 64; i++)
+        frameSupervision(&out, A_RES, i & 1 ? C_RR_NR1 : C_RR_NR0);
+    return 64;
+}
+
+long benchHeader(){
+    for (int i = 0; i < 64; i++)
+        frameInfoHeader(out.data, i & 1);
+    return 64;
+}
+
+// Payload with the given share of FLAG bytes; the rest avoids FLAG and
+// ESCAPE. A negative share gives uniformly random bytes.
+void makePayload(int size, int escapePercent){
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL ^ (size * 131 + escapePercent);
+    payloadSize = size;
+    for (int i = 0; i < size; i++){
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        if (escapePercent < 0)
+            payload[i] = seed >> 32;
+        else if ((int)(seed % 100) < escapePercent)
+            payload[i] = FLAG;
+        else {
+            payload[i] = seed >> 32;
+            if (payload[i] == FLAG || payload[i] == ESCAPE)
+                payload[i] = 0x00;
+        }
+    }
+
+    // The same payload on the wire, for the parser
+    int pos = 0;
+    wireSize = 0;
+    do {
+        int n = 4;
+        unsigned char bcc = 0x00;
+        frameInfoHeader(out.data, 0);
+        pos += frameStuff(&out, &n, payload + pos, size - pos, &bcc);
+        frameClose(&out, n, bcc);
+        memcpy(wire + wireSize, out.data, out.length);
+        wireSize += out.length;
+    } while (pos < size);
+}
+
+void makeSupervisionWire(){
+    wireSize = 0;
+    for (int i = 0; i < 64; i++){
+        frameSupervision(&out, A_RES, i & 1 ? C_RR_NR1 : C_RR_NR0);
+        memcpy(wire + wireSize, out.data, out.length);
+        wireSize += out.length;
+    }
+}
+
+int compareDouble(const void* a, const void* b){
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+void run(const char* name, benchFunction f, int size, int escapePercent, long long bytes, int samples){
+    const char* framing = frameFraming() == FRAMING_COBS ? "cobs" : "hdlc";
+    double nsPerFrame[MAX_SAMPLES];
+    double bytesPerCycle[MAX_SAMPLES];
+    long iterations = 1;
+    long frames = 0;
+
+    // Warm up, and find how many passes make one sample
+    long long start = metricsNow();
+    long passes = 0;
+    while (metricsNow() - start < WARMUP_NS){
+        f();
+        passes++;
+    }
+    iterations = passes * SAMPLE_NS / WARMUP_NS;
+    if (iterations < 1)
+        iterations = 1;
+
+    for (int s = 0; s < samples; s++){
+        frames = 0;
+        unsigned long long c0 = cycles();
+        long long t0 = metricsNow();
+        for (long i = 0; i < iterations; i++)
+            frames += f();
+        long long t1 = metricsNow();
+        unsigned long long c1 = cycles();
+        nsPerFrame[s] = (double)(t1 - t0) / frames;
+        bytesPerCycle[s] = c1 > c0 ? (double)bytes * iterations / (c1 - c0) : 0.0;
+    }
+
+    qsort(nsPerFrame, samples, sizeof(double), compareDouble);
+    qsort(bytesPerCycle, samples, sizeof(double), compareDouble);
+    double median = nsPerFrame[samples / 2];
+    // Spread is the interquartile range relative to the median
+    double spread = median > 0 ? 100.0 * (nsPerFrame[samples * 3 / 4] - nsPerFrame[samples / 4]) / median : 0.0;
+    printf("%s,%s,%d,%d,%ld,%.2f,%.2f,%.1f,%.3f,%.3f\n", name, framing, size, escapePercent, frames / iterations,
+           median, nsPerFrame[0], spread, bytesPerCycle[samples / 2], size > 0 ? (double)wireSize / size : 0.0);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int cpu = argc > 1 ? atoi(argv[1]) : 0;
+    int samples = argc > 2 ? atoi(argv[2]) : 21;
+    if (samples < 1 || samples > MAX_SAMPLES)
+        samples = 21;
+
+    cpu_set_t set, everywhere;
+    sched_getaffinity(0, sizeof(everywhere), &everywhere);
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        perror("sched_setaffinity");
+
+    parserInit(&parser, parsed, sizeof(parsed));
+    printf("benchmark,framing,payload,escape_pct,frames,ns_per_frame,ns_per_frame_min,spread_pct,"
+           "bytes_per_cycle,wire_ratio\n");
+
+    for (unsigned k = 0; k < sizeof(framings) / sizeof(framings[0]); k++){
+        frameSetFraming(framings[k]);
+        parser.framing = framings[k];
+        for (unsigned i = 0; i < sizeof(payloadSizes) / sizeof(payloadSizes[0]); i++){
+            for (unsigned j = 0; j < sizeof(escapePercents) / sizeof(escapePercents[0]); j++){
+                int size = payloadSizes[i];
+                int escapes = escapePercents[j];
+                makePayload(size, escapes);
+                run("stuff", benchStuff, size, escapes, size, samples);
+                run("create", benchCreate, size, escapes, size, samples);
+                run("parse_i", benchParse, size, escapes, wireSize, samples);
+                run("parse_generic", benchParseGeneric, size, escapes, wireSize, samples);
+                parser.skip = 0xFF;
+                run("parse_duplicate", benchParse, size, escapes, wireSize, samples);
+                parser.skip = 0;
+            }
+        }
+    }
+    frameSetFraming(FRAMING_HDLC);
+    parser.framing = FRAMING_HDLC;
+
+    // Workers inherit the affinity they are started with
+    if (!framePoolInit()){
+        printf("error: cannot allocate frame pool\n");
+        return 1;
+    }
+    for (unsigned j = 0; j < sizeof(escapePercents) / sizeof(escapePercents[0]); j += 2){
+        makePayload(MAX_PAYLOAD, escapePercents[j]);
+        for (int i = 0; i < ENCODE_BYTES; i++)
+            stream[i] = payload[i % MAX_PAYLOAD];
+        benchEncode();
+        wireSize = streamWire;
+        for (unsigned k = 0; k < sizeof(workerCounts) / sizeof(workerCounts[0]); k++){
+            char name[32];
+            snprintf(name, sizeof(name), "encode_workers_%d", workerCounts[k]);
+            sched_setaffinity(0, sizeof(everywhere), &everywhere);
+            if (workerCounts[k] > 0 && !encoderStart(&encoder, workerCounts[k])){
+                perror("encoderStart");
+                return 1;
+            }
+            sched_setaffinity(0, sizeof(set), &set);
+            run(name, benchEncode, ENCODE_BYTES, escapePercents[j], ENCODE_BYTES, samples);
+            if (encoder.workers > 0)
+                encoderStop(&encoder);
+        }
+    }
+
+    makeSupervisionWire();
+    run("parse_supervision", benchParse, 0, 0, wireSize, samples);
+    run("supervision", benchSupervision, 0, 0, 64 * 5, samples);
+    run("header", benchHeader, 0, 0, 64 * 4, samples);
+    return 0;
+}
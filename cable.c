@@ -0,0 +1,165 @@
+// Virtual serial cable between two pseudo-terminals
+//
+// Creates two PTYs, publishes their slave ends as the given symlinks and
+// copies every byte written on one side to the other. With a baudrate the
+// bytes are paced like a real line (10 bits per byte), each direction on its
+// own clock as on a full-duplex serial cable; without one they go through at
+// memory speed. A delay holds every byte that much longer on top, like a
+// modem or radio link between the two ends.
+//
+// Build: gcc -o cable cable.c
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNKS 64 // reads held per direction while the line is busy
+
+const char* links[2];
+
+// Bytes read from one end, due at the other once the line has carried them
+struct chunk {
+    long long due;
+    int len;
+    unsigned char data[4096];
+};
+
+struct direction {
+    struct chunk chunks[CHUNKS];
+    int head;
+    int count;
+    long long lineFree; // when the last held byte has crossed the line
+};
+
+struct direction directions[2];
+
+void removeLinks(int signal){
+    unlink(links[0]);
+    unlink(links[1]);
+    exit(0);
+}
+
+int openEnd(const char* link){
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0){
+        perror("posix_openpt");
+        exit(-1);
+    }
+    const char* name = ptsname(master);
+
+    // Keep a slave open so the master never sees a hangup between programs
+    int slave = open(name, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    tcgetattr(slave, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    unlink(link);
+    if (symlink(name, link) != 0){
+        perror(link);
+        exit(-1);
+    }
+    return master;
+}
+
+long long now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000LL + t.tv_nsec;
+}
+
+// Time n bytes take on the line, queued behind what it still carries
+long long pace(struct direction* d, int bytes, long baudrate){
+    long long start = d->lineFree > now() ? d->lineFree : now();
+    if (baudrate > 0)
+        start += (long long)bytes * 10 * 1000000000LL / baudrate;
+    d->lineFree = start;
+    return start;
+}
+
+void writeAll(int fd, const unsigned char* buf, int n){
+    for (int done = 0; done < n; ){
+        int w = write(fd, buf + done, n - done);
+        if (w < 0 && errno != EINTR && errno != EAGAIN)
+            break;
+        if (w > 0)
+            done += w;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Incorrect program usage\n"
+               "Usage: %s <linkA> <linkB> [baudrate] [delay ms]\n"
+               "Example: %s /tmp/ttyS10 /tmp/ttyS11 38400\n"
+               "         %s /tmp/ttyS10 /tmp/ttyS11 115200 50\n",
+               argv[0],
+               argv[0],
+               argv[0]);
+        exit(1);
+    }
+    links[0] = argv[1];
+    links[1] = argv[2];
+    long baudrate = argc > 3 ? atol(argv[3]) : 0;
+    long long delay = argc > 4 ? atol(argv[4]) * 1000000LL : 0;
+
+    struct pollfd ends[2];
+    ends[0].fd = openEnd(links[0]);
+    ends[1].fd = openEnd(links[1]);
+    ends[0].events = ends[1].events = POLLIN;
+
+    signal(SIGINT, removeLinks);
+    signal(SIGTERM, removeLinks);
+    printf("cable ready: %s <-> %s\n", links[0], links[1]);
+    fflush(stdout);
+
+    while (1){
+        // Deliver what is due, then wait for input or the next due chunk.
+        // A direction whose queue is full stops reading until it drains.
+        long long wait = -1;
+        for (int i = 0; i < 2; i++){
+            struct direction* d = &directions[i];
+            while (d->count > 0 && d->chunks[d->head].due <= now()){
+                writeAll(ends[1 - i].fd, d->chunks[d->head].data, d->chunks[d->head].len);
+                d->head = (d->head + 1) % CHUNKS;
+                d->count--;
+            }
+            ends[i].events = d->count < CHUNKS ? POLLIN : 0;
+            if (d->count > 0){
+                long long left = d->chunks[d->head].due - now();
+                if (left < 0)
+                    left = 0;
+                if (wait < 0 || left < wait)
+                    wait = left;
+            }
+        }
+        struct timespec t = { wait / 1000000000LL, wait % 1000000000LL };
+        if (ppoll(ends, 2, wait < 0 ? NULL : &t, NULL) < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < 2; i++){
+            struct direction* d = &directions[i];
+            if (!(ends[i].revents & POLLIN))
+                continue;
+            struct chunk* c = &d->chunks[(d->head + d->count) % CHUNKS];
+            int n = read(ends[i].fd, c->data, sizeof(c->data));
+            if (n <= 0)
+                continue;
+            c->len = n;
+            c->due = pace(d, n, baudrate) + delay;
+            d->count++;
+        }
+    }
+    removeLinks(0);
+    return 0;
+}
@@ -0,0 +1,223 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "delta.h"
+#include "hash.h"
+#include "packet.h"
+
+#define SIGNATURE_MAGIC "RSIG"
+
+// rsync's checksum: a is the plain sum, b the sum weighted by distance to
+// the end of the window, both modulo 2^16
+uint32_t weakChecksum(const unsigned char* data, int len, uint32_t* a, uint32_t* b){
+    uint32_t sa = 0, sb = 0;
+    for (int i = 0; i < len; i++){
+        sa += data[i];
+        sb += (uint32_t)(len - i) * data[i];
+    }
+    *a = sa & 0xFFFF;
+    *b = sb & 0xFFFF;
+    return *a | *b << 16;
+}
+
+// Signature file: "RSIG" | block size (4) | basis size (8) | count (8), then
+// per block its weak checksum (4) and xxHash64 (8)
+int signatureWrite(int basis, int blockSize, FILE* out){
+    unsigned char header[24];
+    unsigned char entry[12];
+    unsigned char* block = malloc(blockSize);
+    long long size = 0;
+    long long count = 0;
+    uint32_t a, b;
+    if (block == NULL)
+        return 0;
+
+    memcpy(header, SIGNATURE_MAGIC, 4);
+    fwrite(header, 1, sizeof(header), out); // rewritten once the counts are known
+    while (1){
+        int n = 0;
+        while (n < blockSize){
+            int got = pread(basis, block + n, blockSize - n, size + n);
+            if (got <= 0)
+                break;
+            n += got;
+        }
+        if (n == 0)
+            break;
+        putU32(entry, weakChecksum(block, n, &a, &b));
+        putU64(entry + 4, xxh64(block, n, 0));
+        fwrite(entry, 1, sizeof(entry), out);
+        size += n;
+        count++;
+        if (n < blockSize)
+            break;
+    }
+    free(block);
+
+    putU32(header + 4, blockSize);
+    putU64(header + 8, size);
+    putU64(header + 16, count);
+    rewind(out);
+    fwrite(header, 1, sizeof(header), out);
+    return !ferror(out);
+}
+
+int signatureLoad(struct signature* sig, const char* name){
+    unsigned char header[24];
+    unsigned char entry[12];
+    FILE* in = fopen(name, "rb");
+    memset(sig, 0, sizeof(*sig));
+    if (in == NULL)
+        return 0;
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, SIGNATURE_MAGIC, 4) != 0){
+        fclose(in);
+        return 0;
+    }
+    unsigned int blockSize = getU32(header + 4);
+    sig->basisSize = getU64(header + 8);
+    sig->count = getU64(header + 16);
+
+    // Nothing is sized from the header until it adds up: one entry per
+    // block of the basis, and exactly that many entries in the file
+    struct stat st;
+    if (blockSize == 0 || blockSize > DELTA_MAX_BLOCK_SIZE || sig->basisSize < 0 ||
+        sig->count != sig->basisSize / blockSize + (sig->basisSize % blockSize != 0) ||
+        fstat(fileno(in), &st) != 0 || st.st_size < (long long)sizeof(header) ||
+        (st.st_size - sizeof(header)) % sizeof(entry) != 0 || (long long)((st.st_size - sizeof(header)) / sizeof(entry)) != sig->count){
+        fclose(in);
+        memset(sig, 0, sizeof(*sig));
+        return 0;
+    }
+    sig->blockSize = blockSize;
+
+    sig->tableSize = 1;
+    while (sig->tableSize < 2 * sig->count)
+        sig->tableSize <<= 1;
+    sig->weak = malloc(sig->count * sizeof(uint32_t) + 1);
+    sig->strong = malloc(sig->count * sizeof(uint64_t) + 1);
+    sig->table = calloc(sig->tableSize, sizeof(long long));
+    if (sig->weak == NULL || sig->strong == NULL || sig->table == NULL){
+        fclose(in);
+        signatureFree(sig);
+        return 0;
+    }
+
+    for (long long i = 0; i < sig->count; i++){
+        if (fread(entry, 1, sizeof(entry), in) != sizeof(entry)){
+            fclose(in);
+            signatureFree(sig);
+            return 0;
+        }
+        sig->weak[i] = getU32(entry);
+        sig->strong[i] = getU64(entry + 4);
+        // Only whole blocks can match a full window
+        if (i * sig->blockSize + sig->blockSize > sig->basisSize)
+            continue;
+        long long slot = sig->weak[i] & (sig->tableSize - 1);
+        while (sig->table[slot] != 0)
+            slot = (slot + 1) & (sig->tableSize - 1);
+        sig->table[slot] = i + 1;
+    }
+    fclose(in);
+    return 1;
+}
+
+void signatureFree(struct signature* sig){
+    free(sig->weak);
+    free(sig->strong);
+    free(sig->table);
+    memset(sig, 0, sizeof(*sig));
+}
+
+// Basis block matching the window, or -1. The strong hash is only worked out
+// once a weak checksum agrees.
+static long long findBlock(const struct signature* sig, uint32_t weak, const unsigned char* window){
+    if (sig->tableSize == 0)
+        return -1;
+    uint64_t strong = 0;
+    int haveStrong = 0;
+    long long slot = weak & (sig->tableSize - 1);
+    while (sig->table[slot] != 0){
+        long long i = sig->table[slot] - 1;
+        if (sig->weak[i] == weak){
+            if (!haveStrong){
+                strong = xxh64(window, sig->blockSize, 0);
+                haveStrong = 1;
+            }
+            if (sig->strong[i] == strong)
+                return i;
+        }
+        slot = (slot + 1) & (sig->tableSize - 1);
+    }
+    return -1;
+}
+
+void deltaInit(struct deltaScan* d, const unsigned char* src, long long size){
+    memset(d, 0, sizeof(*d));
+    d->src = src;
+    d->size = size;
+}
+
+static int literalPiece(struct deltaScan* d, struct deltaPiece* piece, long long end){
+    piece->type = DELTA_LITERAL;
+    piece->srcOffset = d->literal;
+    piece->basisOffset = 0;
+    piece->length = end - d->literal;
+    d->literal = end;
+    return 1;
+}
+
+// Hands out the next literal run or basis copy, in file order. Returns 0 once
+// the whole file has been covered.
+int deltaNext(struct deltaScan* d, const struct signature* sig, struct deltaPiece* piece){
+    int blockSize = sig->blockSize;
+
+    while (d->pos + blockSize <= d->size){
+        if (!d->rolling){
+            weakChecksum(d->src + d->pos, blockSize, &d->a, &d->b);
+            d->rolling = 1;
+        }
+        long long i = findBlock(sig, d->a | d->b << 16, d->src + d->pos);
+        if (i >= 0){
+            // Bytes before the match go first; the match is found again next call
+            if (d->literal < d->pos)
+                return literalPiece(d, piece, d->pos);
+
+            piece->type = DELTA_COPY;
+            piece->srcOffset = d->pos;
+            piece->basisOffset = i * blockSize;
+            piece->length = blockSize;
+            d->pos += blockSize;
+            // Runs of consecutive basis blocks become one copy
+            while (++i < sig->count && d->pos + blockSize <= d->size &&
+                   (i + 1) * blockSize <= sig->basisSize &&
+                   xxh64(d->src + d->pos, blockSize, 0) == sig->strong[i]){
+                piece->length += blockSize;
+                d->pos += blockSize;
+            }
+            d->literal = d->pos;
+            d->rolling = 0;
+            return 1;
+        }
+
+        if (d->pos + blockSize < d->size){
+            unsigned char out = d->src[d->pos];
+            unsigned char in = d->src[d->pos + blockSize];
+            d->a = (d->a - out + in) & 0xFFFF;
+            d->b = (d->b - (uint32_t)blockSize * out + d->a) & 0xFFFF;
+        }
+        d->pos++;
+        if (d->pos - d->literal >= DELTA_MAX_LITERAL)
+            return literalPiece(d, piece, d->pos);
+    }
+
+    if (d->literal < d->size){
+        d->pos = d->size;
+        return literalPiece(d, piece, d->size);
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+// rsync-style delta transfer
+//
+// The station that already holds an old copy (the basis) describes it with a
+// signature: a rolling weak checksum and an xxHash64 per block. The sender
+// slides a window over its new file, and wherever the window matches a basis
+// block it sends a COPY reference instead of the bytes.
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DELTA_BLOCK_SIZE 2048
+#define DELTA_MAX_BLOCK_SIZE (1 << 24)
+#define DELTA_MAX_LITERAL 65536 // literal runs are handed out at least this often
+
+struct signature {
+    int blockSize;
+    long long basisSize;
+    long long count;
+    uint32_t* weak;
+    uint64_t* strong;
+    long long* table; // open addressing on the weak checksum, block index + 1
+    long long tableSize;
+};
+
+enum { DELTA_LITERAL, DELTA_COPY };
+
+struct deltaPiece {
+    int type;
+    long long srcOffset;   // where the piece starts in the new file
+    long long basisOffset; // COPY only
+    long long length;
+};
+
+struct deltaScan {
+    const unsigned char* src;
+    long long size;
+    long long pos;     // start of the window
+    long long literal; // start of the literal run not handed out yet
+    int rolling;       // a and b are valid for the window at pos
+    uint32_t a;
+    uint32_t b;
+};
+
+uint32_t weakChecksum(const unsigned char* data, int len, uint32_t* a, uint32_t* b);
+int signatureWrite(int basis, int blockSize, FILE* out);
+int signatureLoad(struct signature* sig, const char* name);
+void signatureFree(struct signature* sig);
+
+void deltaInit(struct deltaScan* d, const unsigned char* src, long long size);
+int deltaNext(struct deltaScan* d, const struct signature* sig, struct deltaPiece* piece);
+
+#endif
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "duplex.h"
+#include "encoder.h"
+#include "metrics.h"
+#include "packet.h"
+#include "trace.h"
+
+int duplexSendOpen(struct duplexSend* d, const char* name, const struct arqConfig* config, unsigned char address){
+    if (!sourceOpen(&d->src, name))
+        return 0;
+    arqSenderInit(&d->arq, config);
+    xxh64Init(&d->hash, 0);
+    d->head = 0;
+    d->ready = 0;
+    d->endQueued = 0;
+    d->address = address;
+    return 1;
+}
+
+// Tops up the ring without ever waiting on the input, since the same loop
+// also serves the other direction. Packets are built and encoded as the
+// forward stream's are; the header is left for send time.
+void duplexSendFill(struct duplexSend* d){
+    unsigned char packet[FRAME_SIZE];
+    while (d->ready < DUPLEX_RING && !d->endQueued){
+        struct frame* f = frameAcquire();
+        if (f == NULL)
+            break;
+        int length;
+        int available = sourceFill(&d->src, 0);
+        f->payload = 0;
+        if (available > 0){
+            length = packetData(packet, d->src.buf + d->src.pos, available, &f->payload);
+            xxh64Update(&d->hash, d->src.buf + d->src.pos, f->payload);
+            sourceConsume(&d->src, f->payload);
+        }
+        else if (d->src.eof){
+            length = packetEnd(packet, d->src.total, xxh64Digest(&d->hash));
+            d->endQueued = 1;
+        }
+        else {
+            frameRelease(f);
+            break;
+        }
+        encodePacket(f, packet, length);
+        d->ring[(d->head + d->ready) % DUPLEX_RING] = f;
+        d->ready++;
+    }
+}
+
+// A frame can go on the wire right now, so an RR owed to the other end can
+// ride on it. Not with a window of 1: the other end could send nothing more
+// until our whole I-frame had crossed the line, where an RR takes a few bytes.
+int duplexSendCanSend(const struct duplexSend* d){
+    if (d->arq.config.window == 1)
+        return 0;
+    long long seq = arqSenderPick(&d->arq);
+    return seq >= 0 && seq - d->arq.base < d->ready;
+}
+
+// Puts everything the window allows on the wire in one write, each frame
+// acknowledging up to nr. Returns the frames sent, -1 when the port failed.
+int duplexSendPump(struct duplexSend* d, struct ioEngine* io, int nr){
+    long long seq;
+    int queued = 0;
+    while ((seq = arqSenderPick(&d->arq)) >= 0 && seq - d->arq.base < d->ready){
+        struct frame* f = d->ring[(d->head + seq - d->arq.base) % DUPLEX_RING];
+        frameInfoHeaderAck(f->data, d->address, seq % d->arq.config.modulus, nr);
+        struct iovec iov = { .iov_base = f->data, .iov_len = f->length };
+        if (ioQueuev(io, &iov, 1) < 0){
+            if (errno != EAGAIN)
+                return -1;
+            break;
+        }
+        traceRecord(TRACE_OUT, f->data, f->length);
+        metricAdd(framesSent, 1);
+        metricAdd(wireBytesOut, f->length);
+        if (seq < d->arq.highest)
+            metricAdd(retransmissions, 1);
+        arqSenderSent(&d->arq, seq);
+        queued++;
+    }
+    if (queued > 0){
+        if (ioFlush(io) < 0)
+            return -1;
+        arqSenderDeparted(&d->arq, metricsNow() + ioDrainTime(io));
+    }
+    return queued;
+}
+
+// RR, REJ or SREJ from the other end, or the N(R) of one of its I-frames as
+// an RR. Acknowledged frames leave the ring.
+void duplexSendReply(struct duplexSend* d, int type, int nr, long long now){
+    long long acked = d->arq.base;
+    if (type == FRAME_REJ || type == FRAME_SREJ)
+        metricAdd(framesRejected, 1);
+    if (type == FRAME_REJ)
+        arqSenderReject(&d->arq, nr, now);
+    else if (type == FRAME_SREJ)
+        arqSenderSelectiveReject(&d->arq, nr, now);
+    else
+        arqSenderAck(&d->arq, nr, now);
+    for (; acked < d->arq.base; acked++){
+        metricAdd(payloadBytesOut, d->ring[d->head]->payload);
+        frameRelease(d->ring[d->head]);
+        d->head = (d->head + 1) % DUPLEX_RING;
+        d->ready--;
+    }
+}
+
+// The END went out and was acknowledged
+int duplexSendDone(const struct duplexSend* d){
+    return d->endQueued && d->ready == 0;
+}
+
+void duplexSendClose(struct duplexSend* d){
+    for (; d->ready > 0; d->ready--){
+        frameRelease(d->ring[d->head]);
+        d->head = (d->head + 1) % DUPLEX_RING;
+    }
+    sourceClose(&d->src);
+}
+
+int duplexReceiveOpen(struct duplexReceive* r, const char* name, const struct arqConfig* config){
+    if (!sinkOpen(&r->sink, name, 1))
+        return 0;
+    arqReceiverInit(&r->arq, config);
+    xxh64Init(&r->hash, 0);
+    r->received = 0;
+    r->done = 0;
+    r->ok = 0;
+    return 1;
+}
+
+static int deliver(struct duplexReceive* r, const unsigned char* packet, int length){
+    if (length > 0 && packet[0] == PKT_DATA){
+        if (!sinkWrite(&r->sink, packet + 1, length - 1))
+            return 0;
+        xxh64Update(&r->hash, packet + 1, length - 1);
+        metricAdd(payloadBytesIn, length - 1);
+        r->received += length - 1;
+    }
+    else if (length == PKT_END_SIZE && packet[0] == PKT_END){
+        r->done = 1;
+        r->ok = (long long)getU64(packet + 1) == r->received && getU64(packet + 9) == xxh64Digest(&r->hash);
+    }
+    return 1;
+}
+
+// Takes an I-frame of the reverse stream and says, as arqReceive() does,
+// which reply it needs. Returns 0 when the output cannot be written.
+int duplexReceiveFrame(struct duplexReceive* r, const struct frameInfo* info, int* reply, int* replySeq){
+    switch (arqReceive(&r->arq, info->seq, info->bccOk, reply, replySeq)){
+        case ARQ_DELIVER:
+            if (!deliver(r, info->payload, info->length))
+                return 0;
+            for (long long held = r->arq.expected - r->arq.released; held < r->arq.expected; held++){
+                int slot = arqReceiverSlot(&r->arq, held);
+                if (!deliver(r, r->reorder[slot], r->reorderLength[slot]))
+                    return 0;
+            }
+            break;
+        case ARQ_BUFFER:
+            memcpy(r->reorder[arqReceiverSlot(&r->arq, r->arq.frame)], info->payload, info->length);
+            r->reorderLength[arqReceiverSlot(&r->arq, r->arq.frame)] = info->length;
+            metricAdd(reordered, 1);
+            break;
+        case ARQ_DUPLICATE:
+            metricAdd(duplicates, 1);
+            break;
+        case ARQ_REJECT:
+            metricAdd(framesRejected, 1);
+            break;
+    }
+    return 1;
+}
+
+// N(R) to stamp into the I-frames going the other way
+int duplexReceiveNr(const struct duplexReceive* r){
+    return r->arq.expected % r->arq.modulus;
+}
+
+int duplexReceiveClose(struct duplexReceive* r){
+    return sinkClose(&r->sink);
+}
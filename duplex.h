@@ -0,0 +1,71 @@
+// Second transfer running the other way over the same link
+//
+// write_datalink --receive <file> and read_datalink --send <file> make the
+// link full duplex: while the receiver takes the sender's file it sends one
+// of its own, under the same ARQ mode, window and framing. The sender asks
+// for it with OPTION_DUPLEX in the SET and the UA echoes it when the receiver
+// has something to send.
+//
+// Each end stamps its own N(R) into every I-frame it sends (C_I_ACK), so
+// while both directions are busy the acknowledgments ride on the data and an
+// RR only goes out when its end has nothing to send at that moment. REJ and
+// SREJ always go out as supervision frames.
+//
+// The reverse stream is plain: DATA packets, then an END with the size and
+// xxHash64 of the whole stream. The sender sends DISC only once it holds that
+// END, so a DISC also tells the receiver its file arrived.
+
+#ifndef DUPLEX_H
+#define DUPLEX_H
+
+#include "arq.h"
+#include "framepool.h"
+#include "frameparser.h"
+#include "framesink.h"
+#include "framesource.h"
+#include "hash.h"
+#include "ioengine.h"
+#include "protocol.h"
+
+#define DUPLEX_RING 8                      // the whole window, and frames prepared ahead
+#define DUPLEX_REORDER (SEQ_MODULUS / 2)   // the largest Selective Repeat window
+
+// The end that sends the reverse stream. Like the sender's pool, the ring
+// holds every frame from arq.base on and doubles as the retransmission buffer.
+struct duplexSend {
+    struct arqSender arq;
+    struct frameSource src;
+    struct xxh64 hash;
+    struct frame* ring[DUPLEX_RING];
+    int head;
+    int ready;         // frames in the ring, acknowledged or not
+    int endQueued;
+    unsigned char address;
+};
+
+// The end that takes it
+struct duplexReceive {
+    struct arqReceiver arq;
+    struct frameSink sink;
+    struct xxh64 hash;
+    long long received;
+    int done;          // END arrived
+    int ok;            // and its size and hash matched
+    unsigned char reorder[DUPLEX_REORDER][FRAME_SIZE];
+    int reorderLength[DUPLEX_REORDER];
+};
+
+int duplexSendOpen(struct duplexSend* d, const char* name, const struct arqConfig* config, unsigned char address);
+void duplexSendFill(struct duplexSend* d);
+int duplexSendCanSend(const struct duplexSend* d);
+int duplexSendPump(struct duplexSend* d, struct ioEngine* io, int nr);
+void duplexSendReply(struct duplexSend* d, int type, int nr, long long now);
+int duplexSendDone(const struct duplexSend* d);
+void duplexSendClose(struct duplexSend* d);
+
+int duplexReceiveOpen(struct duplexReceive* r, const char* name, const struct arqConfig* config);
+int duplexReceiveFrame(struct duplexReceive* r, const struct frameInfo* info, int* reply, int* replySeq);
+int duplexReceiveNr(const struct duplexReceive* r);
+int duplexReceiveClose(struct duplexReceive* r);
+
+#endif
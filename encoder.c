@@ -0,0 +1,134 @@
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encoder.h"
+#include "realtime.h"
+
+enum { JOB_FREE, JOB_QUEUED, JOB_DONE };
+
+// Reads DATALINK_WORKERS=<n>, the encoding threads. Unset or 0 keeps
+// encoding inline on the transmitting thread. Returns 0 when it cannot be
+// parsed.
+int encoderWorkersFromEnv(int* workers){
+    const char* want = getenv("DATALINK_WORKERS");
+    *workers = 0;
+    if (want == NULL || *want == '\0')
+        return 1;
+    char* end;
+    long n = strtol(want, &end, 10);
+    if (*end != '\0' || n < 0 || n > ENCODER_MAX_WORKERS){
+        printf("DATALINK_WORKERS must be 0 to %d, not %s\n", ENCODER_MAX_WORKERS, want);
+        return 0;
+    }
+    *workers = n;
+    return 1;
+}
+
+// Stuffs and checksums a whole packet into f. The header is left for send
+// time, since Ns is only known then.
+void encodePacket(struct frame* f, const unsigned char* packet, int length){
+    int numOfBytes = 4;
+    unsigned char bcc = 0x00;
+    frameStuff(f, &numOfBytes, packet, length, &bcc);
+    frameClose(f, numOfBytes, bcc);
+}
+
+static void* work(void* arg){
+    struct encoder* e = arg;
+    realtimeThread();
+    while (1){
+        if (sem_wait(&e->work) != 0){
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (atomic_load(&e->stopping))
+            break;
+        long long claimed = atomic_fetch_add(&e->claimed, 1);
+        struct encodeJob* job = &e->jobs[claimed % ENCODER_RING];
+        while (atomic_load_explicit(&job->state, memory_order_acquire) != JOB_QUEUED)
+            sched_yield();
+        encodePacket(job->f, job->packet, job->length);
+        atomic_store_explicit(&job->state, JOB_DONE, memory_order_release);
+    }
+    return NULL;
+}
+
+// Workers block every signal, so SIGALRM and SIGUSR1 still land on the
+// link loop
+int encoderStart(struct encoder* e, int workers){
+    e->workers = 0;
+    e->tail = 0;
+    e->head = 0;
+    atomic_init(&e->claimed, 0);
+    atomic_init(&e->stopping, 0);
+    for (int i = 0; i < ENCODER_RING; i++)
+        atomic_init(&e->jobs[i].state, JOB_FREE);
+    if (sem_init(&e->work, 0, 0) != 0)
+        return 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (; e->workers < workers; e->workers++)
+        if (pthread_create(&e->threads[e->workers], NULL, work, e) != 0)
+            break;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (e->workers < workers){
+        encoderStop(e);
+        return 0;
+    }
+    return 1;
+}
+
+// Jobs that can be submitted before the oldest is collected
+int encoderRoom(const struct encoder* e){
+    return ENCODER_RING - (e->tail - e->head);
+}
+
+int encoderPending(const struct encoder* e){
+    return e->tail - e->head;
+}
+
+// Copies the packet, so the caller's buffer is free again on return
+void encoderSubmit(struct encoder* e, struct frame* f, const unsigned char* packet, int length){
+    struct encodeJob* job = &e->jobs[e->tail % ENCODER_RING];
+    job->f = f;
+    memcpy(job->packet, packet, length);
+    job->length = length;
+    atomic_store_explicit(&job->state, JOB_QUEUED, memory_order_release);
+    e->tail++;
+    sem_post(&e->work);
+}
+
+// The oldest frame submitted once it is encoded, or NULL when there is none
+// yet. With wait, yields to the workers until it is.
+struct frame* encoderCollect(struct encoder* e, int wait){
+    if (e->head == e->tail)
+        return NULL;
+    struct encodeJob* job = &e->jobs[e->head % ENCODER_RING];
+    while (atomic_load_explicit(&job->state, memory_order_acquire) != JOB_DONE){
+        if (!wait)
+            return NULL;
+        sched_yield();
+    }
+    atomic_store_explicit(&job->state, JOB_FREE, memory_order_relaxed);
+    e->head++;
+    return job->f;
+}
+
+// Frames still in the ring go back to the pool
+void encoderStop(struct encoder* e){
+    atomic_store(&e->stopping, 1);
+    for (int i = 0; i < e->workers; i++)
+        sem_post(&e->work);
+    for (int i = 0; i < e->workers; i++)
+        pthread_join(e->threads[i], NULL);
+    for (; e->head < e->tail; e->head++)
+        frameRelease(e->jobs[e->head % ENCODER_RING].f);
+    sem_destroy(&e->work);
+    e->workers = 0;
+}
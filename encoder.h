@@ -0,0 +1,55 @@
+// Frame encoding on worker threads
+//
+// The transmitting thread still decides, in order, what every frame carries:
+// it reads and hashes the input and cuts it into packets where frameSpan()
+// says an I-frame is full. Byte stuffing or COBS and BCC2, the part of a
+// frame's cost that grows with its payload, is left to a pool of workers.
+//
+// Jobs sit in a ring in sequence order. The transmitter fills the slot at
+// tail, a worker claims the oldest unclaimed job with an atomic increment of
+// claimed and flags it done, and the transmitter takes frames back from head
+// strictly in order, so they are byte for byte what inline encoding would
+// have built. Nothing on this path takes a lock; a semaphore only puts idle
+// workers to sleep.
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "framepool.h"
+
+#define ENCODER_MAX_WORKERS 8
+#define ENCODER_RING 16 // jobs submitted and not yet collected
+
+struct encodeJob {
+    struct frame* f;
+    unsigned char packet[FRAME_SIZE]; // plain packet, as frameStuff() takes it
+    int length;
+    atomic_int state;                 // free, queued or done
+};
+
+struct encoder {
+    int workers;
+    pthread_t threads[ENCODER_MAX_WORKERS];
+    struct encodeJob jobs[ENCODER_RING];
+    long long tail;        // jobs submitted, moved by the transmitter only
+    long long head;        // jobs collected, likewise
+    atomic_llong claimed;  // jobs taken by workers
+    atomic_int stopping;
+    sem_t work;            // posted once per job
+};
+
+int encoderWorkersFromEnv(int* workers);
+void encodePacket(struct frame* f, const unsigned char* packet, int length);
+
+int encoderStart(struct encoder* e, int workers);
+int encoderRoom(const struct encoder* e);
+int encoderPending(const struct encoder* e);
+void encoderSubmit(struct encoder* e, struct frame* f, const unsigned char* packet, int length);
+struct frame* encoderCollect(struct encoder* e, int wait);
+void encoderStop(struct encoder* e);
+
+#endif
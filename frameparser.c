@@ -0,0 +1,409 @@
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "frameparser.h"
+#include "ioengine.h"
+#include "metrics.h"
+#include "probes.h"
+#include "protocol.h"
+#include "trace.h"
+
+// Parser states. The low nibble of a table entry is the next state, the high
+// nibble the action to run on the byte.
+enum {
+    P_HUNT,  // waiting for an opening FLAG
+    P_FLAG,  // after a FLAG, more FLAGs are idle fill
+    P_ADDR,
+    P_CTRL,
+    P_BCC1,  // header checked, FLAG here ends a supervision frame
+    P_DATA,
+    P_ESC,   // after ESCAPE inside the frame
+    P_SKIP,  // I-frame nobody wants, passed over up to its closing FLAG
+    P_STATES
+};
+
+enum {
+    ACT_NONE,
+    ACT_ADDR,   // save the address byte
+    ACT_CTRL,   // save the control byte
+    ACT_BCC1,   // check the header, drop the frame on mismatch
+    ACT_STORE,  // append a data byte
+    ACT_UNESC,  // append an escaped data byte
+    ACT_SUP,    // frame ended after BCC1: supervision, or an I-frame without BCC2
+    ACT_INFO,   // I-frame complete, last stored byte is BCC2
+    ACT_ABORT,  // FLAG right after ESCAPE, frame dropped
+    ACT_SKIP    // unwanted I-frame complete, reported without its data
+};
+
+#define ANY_BYTE 0 ... 255
+#define ENTRY(next, action) ((action) << 4 | (next))
+
+// Frame grammar, one rule per line. Later rules override earlier ones, so
+// every state starts with its ANY_BYTE default.
+#define FRAME_GRAMMAR(RULE)                          \
+    RULE(P_HUNT, ANY_BYTE,   P_HUNT, ACT_NONE)       \
+    RULE(P_HUNT, FLAG,       P_FLAG, ACT_NONE)       \
+    RULE(P_FLAG, ANY_BYTE,   P_HUNT, ACT_NONE)       \
+    RULE(P_FLAG, FLAG,       P_FLAG, ACT_NONE)       \
+    RULE(P_FLAG, A_SET,      P_ADDR, ACT_ADDR)       \
+    RULE(P_FLAG, A_RES,      P_ADDR, ACT_ADDR)       \
+    RULE(P_ADDR, ANY_BYTE,   P_CTRL, ACT_CTRL)       \
+    RULE(P_ADDR, FLAG,       P_FLAG, ACT_NONE)       \
+    RULE(P_CTRL, ANY_BYTE,   P_BCC1, ACT_BCC1)       \
+    RULE(P_CTRL, FLAG,       P_FLAG, ACT_NONE)       \
+    RULE(P_BCC1, ANY_BYTE,   P_DATA, ACT_STORE)      \
+    RULE(P_BCC1, ESCAPE,     P_ESC,  ACT_NONE)       \
+    RULE(P_BCC1, FLAG,       P_FLAG, ACT_SUP)        \
+    RULE(P_DATA, ANY_BYTE,   P_DATA, ACT_STORE)      \
+    RULE(P_DATA, ESCAPE,     P_ESC,  ACT_NONE)       \
+    RULE(P_DATA, FLAG,       P_FLAG, ACT_INFO)       \
+    RULE(P_ESC,  ANY_BYTE,   P_DATA, ACT_UNESC)      \
+    RULE(P_ESC,  FLAG,       P_FLAG, ACT_ABORT)      \
+    RULE(P_SKIP, ANY_BYTE,   P_SKIP, ACT_NONE)       \
+    RULE(P_SKIP, FLAG,       P_FLAG, ACT_SKIP)
+
+// Under COBS only FLAG is special: the data field is stored as it arrived
+// and decoded in place once the closing FLAG is seen
+#define COBS_GRAMMAR(RULE)                           \
+    FRAME_GRAMMAR(RULE)                              \
+    RULE(P_BCC1, ESCAPE,     P_DATA, ACT_STORE)      \
+    RULE(P_DATA, ESCAPE,     P_DATA, ACT_STORE)
+
+#define DFA_RULE(state, byte, next, action) [state][byte] = ENTRY(next, action),
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Woverride-init"
+static const unsigned char dfa[2][P_STATES][256] = {
+    [FRAMING_HDLC] = { FRAME_GRAMMAR(DFA_RULE) },
+    [FRAMING_COBS] = { COBS_GRAMMAR(DFA_RULE) },
+};
+
+// Control field to frame type, numbered frames once per sequence number
+#define EVERY_SEQ(RULE, C, type)                                      \
+    RULE(C(0), type) RULE(C(1), type) RULE(C(2), type) RULE(C(3), type) \
+    RULE(C(4), type) RULE(C(5), type) RULE(C(6), type) RULE(C(7), type)
+
+// I-frames with a piggybacked N(R), once per N(S) and N(R)
+#define EVERY_ACK(RULE, ns)                                                   \
+    RULE(C_I_ACK(ns, 0), FRAME_I) RULE(C_I_ACK(ns, 1), FRAME_I)             \
+    RULE(C_I_ACK(ns, 2), FRAME_I) RULE(C_I_ACK(ns, 3), FRAME_I)             \
+    RULE(C_I_ACK(ns, 4), FRAME_I) RULE(C_I_ACK(ns, 5), FRAME_I)             \
+    RULE(C_I_ACK(ns, 6), FRAME_I) RULE(C_I_ACK(ns, 7), FRAME_I)
+
+#define CONTROL_GRAMMAR(RULE)          \
+    RULE(C_SET,     FRAME_SET)         \
+    RULE(C_UA,      FRAME_UA)          \
+    RULE(C_DISC,    FRAME_DISC)        \
+    EVERY_SEQ(RULE, C_RR,   FRAME_RR)   \
+    EVERY_SEQ(RULE, C_REJ,  FRAME_REJ)  \
+    EVERY_SEQ(RULE, C_SREJ, FRAME_SREJ) \
+    EVERY_SEQ(RULE, C_RNR,  FRAME_RNR)  \
+    EVERY_SEQ(RULE, C_I,    FRAME_I)    \
+    EVERY_ACK(RULE, 0) EVERY_ACK(RULE, 1) \
+    EVERY_ACK(RULE, 2) EVERY_ACK(RULE, 3) \
+    EVERY_ACK(RULE, 4) EVERY_ACK(RULE, 5) \
+    EVERY_ACK(RULE, 6) EVERY_ACK(RULE, 7)
+
+#define CONTROL_RULE(control, type) [control] = type,
+
+static const unsigned char controlType[256] = {
+    [ANY_BYTE] = FRAME_UNKNOWN,
+    CONTROL_GRAMMAR(CONTROL_RULE)
+};
+#pragma GCC diagnostic pop
+
+void parserInit(struct frameParser* p, unsigned char* payload, int capacity){
+    memset(p, 0, sizeof(*p));
+    p->state = P_HUNT;
+    p->payload = payload;
+    p->capacity = capacity;
+}
+
+const char* frameTypeName(int type){
+    switch (type){
+        case FRAME_SET: return "SET";
+        case FRAME_UA: return "UA";
+        case FRAME_DISC: return "DISC";
+        case FRAME_RR: return "RR";
+        case FRAME_REJ: return "REJ";
+        case FRAME_SREJ: return "SREJ";
+        case FRAME_RNR: return "RNR";
+        case FRAME_I: return "I";
+        case FRAME_UNKNOWN: return "UNKNOWN";
+    }
+    return "NONE";
+}
+
+// N(S) of an I-frame control byte
+static int infoSeq(unsigned char control){
+    return ((control >> 6) & 1) | ((control >> 3) & 6);
+}
+
+static void report(struct frameParser* p, struct frameInfo* info, int hasData){
+    info->type = controlType[p->control];
+    info->address = p->address;
+    info->control = p->control;
+    info->nr = -1;
+    info->skipped = 0;
+    if (info->type == FRAME_I){
+        info->seq = infoSeq(p->control);
+        if (p->control & 0x80)
+            info->nr = (p->control >> 1) & 7;
+    }
+    else
+        info->seq = ((p->control >> 7) & 1) | ((p->control >> 3) & 6);
+    info->payload = p->payload;
+    info->length = hasData && p->length > 0 ? p->length - 1 : 0;
+    info->bccOk = hasData ? p->length > 0 && p->bcc == 0 : 1;
+    if (!info->bccOk)
+        p->stats.dataErrors++;
+    p->stats.frames++;
+}
+
+// True when none of the 8 bytes of v is FLAG or, unless only FLAG counts, ESCAPE
+static int plainWord(uint64_t v, int flagOnly){
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    uint64_t f = v ^ (ones * FLAG);
+    uint64_t e = flagOnly ? ones : v ^ (ones * ESCAPE);
+    return (((f - ones) & ~f & highs) | ((e - ones) & ~e & highs)) == 0;
+}
+
+// Undoes COBS in place over the stored data field and recomputes its XOR
+// with BCC2. Returns 0 when the code bytes do not add up to the field, which
+// the caller reports like a BCC2 mismatch.
+static int cobsDecode(struct frameParser* p){
+    unsigned char* d = p->payload;
+    int in = 0, out = 0;
+    unsigned char bcc = 0;
+    while (in < p->length){
+        int code = d[in++] ^ FLAG;
+        if (code == 0 || in + code - 1 > p->length)
+            return 0;
+        if (code > 1){
+            memmove(d + out, d + in, code - 1);
+            bcc ^= frameParity(d + out, code - 1);
+            out += code - 1;
+            in += code - 1;
+        }
+        if (code < COBS_BLOCK && in < p->length){
+            d[out++] = FLAG;
+            bcc ^= FLAG;
+        }
+    }
+    p->length = out;
+    p->bcc = bcc;
+    return out > 0;
+}
+
+// The parser proper. It is only ever inlined into the variants below, each
+// with a constant framing and capacity, so the COBS tests fold away and the
+// bounds checks compare against a constant; length and bcc are kept in locals
+// because every store into the payload could otherwise alias them.
+static inline __attribute__((always_inline))
+int feed(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info, int framing, int capacity){
+    const unsigned char (*table)[256] = dfa[framing];
+    int cobs = framing == FRAMING_COBS;
+    unsigned char* payload = p->payload;
+    unsigned char state = p->state;
+    int length = p->length;
+    unsigned char bcc = p->bcc;
+    int i = 0;
+    info->type = FRAME_NONE;
+
+    while (i < len){
+        // The rest of an unwanted frame is only searched for its end
+        if (state == P_SKIP){
+            const unsigned char* end = memchr(buf + i, FLAG, len - i);
+            if (end == NULL){
+                i = len;
+                break;
+            }
+            i = end - buf;
+        }
+        // Runs of plain data are copied a word at a time
+        else if (state == P_DATA){
+            uint64_t acc = 0;
+            while (i + 8 <= len && length + 8 <= capacity){
+                uint64_t v;
+                memcpy(&v, buf + i, 8);
+                if (!plainWord(v, cobs))
+                    break;
+                memcpy(payload + length, &v, 8);
+                acc ^= v;
+                length += 8;
+                i += 8;
+            }
+            acc ^= acc >> 32;
+            acc ^= acc >> 16;
+            acc ^= acc >> 8;
+            bcc ^= (unsigned char)acc;
+            if (i == len)
+                break;
+        }
+
+        unsigned char byte = buf[i++];
+        unsigned char entry = table[state][byte];
+        state = entry & 0x0F;
+
+        switch (entry >> 4){
+            case ACT_NONE:
+                break;
+            case ACT_ADDR:
+                p->address = byte;
+                break;
+            case ACT_CTRL:
+                p->control = byte;
+                break;
+            case ACT_BCC1:
+                if (byte != (p->address ^ p->control)){
+                    p->stats.headerErrors++;
+                    state = P_HUNT;
+                }
+                // Sequence known and header good: the data is only stored
+                // if the caller has a use for it
+                else if (controlType[p->control] == FRAME_I && (p->skip >> infoSeq(p->control)) & 1)
+                    state = P_SKIP;
+                length = 0;
+                bcc = 0;
+                break;
+            case ACT_UNESC:
+                byte = byte ^ 0x20;
+                // fall through
+            case ACT_STORE:
+                if (length == capacity){
+                    p->stats.overflows++;
+                    state = P_HUNT;
+                    break;
+                }
+                payload[length++] = byte;
+                bcc ^= byte;
+                break;
+            case ACT_SUP:
+                // An I-frame cannot end at BCC1: with no BCC2 its data is
+                // unchecked, so it is reported bad and answered with a REJ
+                p->length = length;
+                p->bcc = bcc;
+                report(p, info, controlType[p->control] == FRAME_I);
+                p->state = state;
+                return i;
+            case ACT_INFO:
+                p->length = length;
+                p->bcc = bcc;
+                if (cobs && !cobsDecode(p))
+                    p->length = 0;
+                report(p, info, 1);
+                p->state = state;
+                return i;
+            case ACT_SKIP:
+                p->length = 0;
+                report(p, info, 0);
+                info->skipped = 1;
+                p->stats.skipped++;
+                p->state = state;
+                return i;
+            case ACT_ABORT:
+                break;
+        }
+    }
+    p->length = length;
+    p->bcc = bcc;
+    p->state = state;
+    return i;
+}
+
+// Link profiles with a parser of their own. Every endpoint parses into a
+// FRAME_SIZE buffer, so only the framing agreed at SET/UA tells them apart.
+#define PARSER_PROFILES(PROFILE)         \
+    PROFILE(feedHdlc, FRAMING_HDLC)      \
+    PROFILE(feedCobs, FRAMING_COBS)
+
+#define PROFILE_FEED(name, framing)                                                             \
+    static int name(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info){ \
+        return feed(p, buf, len, info, framing, FRAME_SIZE);                                     \
+    }
+#define PROFILE_ENTRY(name, framing) [framing] = name,
+
+PARSER_PROFILES(PROFILE_FEED)
+
+static int (* const profiles[2])(struct frameParser*, const unsigned char*, int, struct frameInfo*) = {
+    PARSER_PROFILES(PROFILE_ENTRY)
+};
+
+// Same as parserFeed(), with the framing and capacity read from the parser
+// on every call. Any buffer size works; benchcodec measures the variants
+// against it.
+int parserFeedGeneric(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info){
+    return feed(p, buf, len, info, p->framing, p->capacity);
+}
+
+// Consumes bytes until a frame completes. Returns how many bytes were used;
+// info->type is FRAME_NONE if the input ran out first.
+int parserFeed(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info){
+    if (p->capacity != FRAME_SIZE)
+        return parserFeedGeneric(p, buf, len, info);
+    return profiles[p->framing](p, buf, len, info);
+}
+
+void readerInit(struct frameReader* r, int fd, unsigned char* payload, int capacity){
+    r->fd = fd;
+    r->io = NULL;
+    r->pos = 0;
+    r->len = 0;
+    parserInit(&r->parser, payload, capacity);
+}
+
+// Returns 1 with the next frame in info, or 0 when the port has nothing more
+// to give (EAGAIN on a non-blocking port)
+int readFrame(struct frameReader* r, struct frameInfo* info){
+    while (1){
+        if (r->pos < r->len){
+            r->pos += parserFeed(&r->parser, r->buf + r->pos, r->len - r->pos, info);
+            if (info->type != FRAME_NONE){
+                metricAdd(framesReceived, 1);
+                linkProbe4(frame_parsed, info->type, info->seq, info->length, r->readAt);
+                return 1;
+            }
+        }
+        int n;
+        if (r->io != NULL)
+            n = ioRead(r->io, r->buf, sizeof(r->buf));
+        else {
+            n = read(r->fd, r->buf, sizeof(r->buf));
+            metricAdd(syscalls, 1);
+        }
+        if (n <= 0)
+            return 0;
+        r->readAt = metricsNow();
+        metricAdd(wireBytesIn, n);
+        traceRecord(TRACE_IN, r->buf, n);
+        r->pos = 0;
+        r->len = n;
+    }
+}
+
+// Like readFrame(), but on a non-blocking port waits up to ms milliseconds
+// for the rest of the frame instead of giving up on the first EAGAIN. How far
+// past the deadline a wait that timed out woke up goes into wakeLate.
+int readFrameTimeout(struct frameReader* r, struct frameInfo* info, int ms){
+    long long deadline = metricsNow() + ms * 1000000LL;
+    while (!readFrame(r, info)){
+        long long now = metricsNow();
+        int left = (deadline - now + 999999) / 1000000;
+        if (left <= 0)
+            return 0;
+        int ready;
+        if (r->io != NULL)
+            ready = ioWait(r->io, left);
+        else {
+            struct pollfd p = { .fd = r->fd, .events = POLLIN };
+            ready = poll(&p, 1, left);
+            metricAdd(syscalls, 1);
+        }
+        if (ready == 0 && metricsNow() > deadline)
+            histogramRecord(&metrics.wakeLate, metricsNow() - deadline);
+    }
+    return 1;
+}
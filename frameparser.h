@@ -0,0 +1,88 @@
+// Table-driven frame parser shared by both endpoints
+//
+// A single deterministic automaton recognises every frame type. It is fed
+// whatever bytes the serial port returned and reports one frame at a time.
+//
+// Frames are cut through: the header is checked as soon as BCC1 arrives and
+// the data is destuffed into the payload buffer while the rest of the frame
+// is still on the wire, to be used only once BCC2 matches. The caller can
+// name in skip the N(S) values it would throw away (see
+// arqReceiverUnwanted()); such an I-frame is reported as soon as its closing
+// FLAG is found, without its data ever being stored or checked.
+//
+// The parser is compiled once per framing, with FRAME_SIZE as a constant
+// bound, and parserFeed() picks the variant for the framing in use.
+
+#ifndef FRAMEPARSER_H
+#define FRAMEPARSER_H
+
+#include "framepool.h"
+
+struct ioEngine;
+
+enum frameType {
+    FRAME_NONE = 0,
+    FRAME_SET,
+    FRAME_UA,
+    FRAME_DISC,
+    FRAME_RR,
+    FRAME_REJ,
+    FRAME_SREJ,
+    FRAME_RNR,
+    FRAME_I,
+    FRAME_UNKNOWN // well formed, but the control field means nothing to us
+};
+
+struct frameInfo {
+    int type;
+    unsigned char address;
+    unsigned char control;
+    int seq;               // Ns of an I-frame, Nr of RR/REJ/SREJ
+    int nr;                // Nr piggybacked on an I-frame, -1 when none
+    int bccOk;             // BCC2 of an I-frame matched, always 1 when skipped
+    int skipped;           // N(S) was in the parser's skip set, no payload
+    unsigned char* payload;
+    int length;            // payload bytes, BCC2 excluded
+};
+
+struct parserStats {
+    long frames;
+    long headerErrors; // BCC1 mismatch, frame dropped
+    long dataErrors;   // BCC2 mismatch, reported to the caller for a REJ
+    long overflows;    // payload did not fit, frame dropped
+    long skipped;      // I-frames passed over for their N(S)
+};
+
+struct frameParser {
+    unsigned char state;
+    unsigned char address;
+    unsigned char control;
+    unsigned char bcc;     // running XOR of data and BCC2, 0 when they match
+    unsigned char* payload;
+    int length;
+    int capacity;
+    int framing;           // FRAMING_HDLC or FRAMING_COBS for the data field
+    unsigned char skip;    // bit n set: I-frames with N(S) n are not stored
+    struct parserStats stats;
+};
+
+struct frameReader {
+    int fd;
+    struct ioEngine* io;   // reads go through it when set, else straight to fd
+    struct frameParser parser;
+    unsigned char buf[FRAME_SIZE];
+    int pos;
+    int len;
+    long long readAt;      // metricsNow() when the buffered bytes were read
+};
+
+void parserInit(struct frameParser* p, unsigned char* payload, int capacity);
+int parserFeed(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info);
+int parserFeedGeneric(struct frameParser* p, const unsigned char* buf, int len, struct frameInfo* info);
+const char* frameTypeName(int type);
+
+void readerInit(struct frameReader* r, int fd, unsigned char* payload, int capacity);
+int readFrame(struct frameReader* r, struct frameInfo* info);
+int readFrameTimeout(struct frameReader* r, struct frameInfo* info, int ms);
+
+#endif
@@ -0,0 +1,340 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framepool.h"
+#include "protocol.h"
+
+struct poolStats poolStats;
+
+static struct frame* arena = NULL;
+static int framing = FRAMING_HDLC;
+
+// Framing of every I-frame built from here on, as agreed at SET time
+void frameSetFraming(int newFraming){
+    framing = newFraming;
+}
+
+int frameFraming(){
+    return framing;
+}
+
+int framePoolInit(){
+    if (arena != NULL)
+        return 1;
+    arena = calloc(FRAME_POOL_CAPACITY, sizeof(struct frame));
+    if (arena == NULL)
+        return 0;
+    return 1;
+}
+
+struct frame* frameAcquire(){
+    for (int i = 0; i < FRAME_POOL_CAPACITY; i++){
+        if (arena[i].refs == 0){
+            arena[i].refs = 1;
+            arena[i].length = 0;
+            arena[i].payload = 0;
+            arena[i].code = 0;
+            poolStats.acquires++;
+            return &arena[i];
+        }
+    }
+    poolStats.exhausted++;
+    return NULL;
+}
+
+void frameRelease(struct frame* f){
+    if (f == NULL || f->refs == 0)
+        return;
+    f->refs--;
+    if (f->refs == 0)
+        poolStats.releases++;
+}
+
+// Only the first length bytes go on the wire, so whatever an earlier, longer
+// frame left in the slot past them never needs clearing
+void frameFinish(struct frame* f, int length){
+    f->length = length;
+}
+
+// Stuffs as much of data as fits in the frame, keeping room for a stuffed
+// BCC2 and the closing FLAG. Returns how many bytes went in. The counters
+// are copied into locals: a store into f->data could alias them, which would
+// force a reload of both on every byte.
+static int stuffBytes(struct frame* f, int* numOfBytes, const unsigned char* data, int len, unsigned char* bcc){
+    unsigned char* out = f->data;
+    int n = *numOfBytes;
+    unsigned char x = *bcc;
+    int used = 0;
+    for (; used < len; used++){
+        unsigned char byte = data[used];
+        if (byte == FLAG || byte == ESCAPE){
+            if (n + 2 > FRAME_SIZE - 3)
+                break;
+            out[n++] = ESCAPE;
+            out[n++] = byte == FLAG ? FLAG_ESCAPE : ESCAPE_ESCAPE;
+        }
+        else {
+            if (n + 1 > FRAME_SIZE - 3)
+                break;
+            out[n++] = byte;
+        }
+        x ^= byte;
+    }
+    *numOfBytes = n;
+    *bcc = x;
+    return used;
+}
+
+// Appends the stuffed BCC2 and the closing FLAG. BCC2 bypasses the room check
+// in stuffBytes(), which already kept space for it.
+static void closeStuffed(struct frame* f, int numOfBytes, unsigned char bcc){
+    if (bcc == FLAG){
+        f->data[numOfBytes++] = ESCAPE;
+        f->data[numOfBytes++] = FLAG_ESCAPE;
+    }
+    else if (bcc == ESCAPE){
+        f->data[numOfBytes++] = ESCAPE;
+        f->data[numOfBytes++] = ESCAPE_ESCAPE;
+    }
+    else
+        f->data[numOfBytes++] = bcc;
+    f->data[numOfBytes++] = FLAG;
+    frameFinish(f, numOfBytes);
+}
+
+// XOR of n bytes, a word at a time, as BCC2 is computed
+unsigned char frameParity(const unsigned char* data, int n){
+    uint64_t acc = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8){
+        uint64_t v;
+        memcpy(&v, data + i, 8);
+        acc ^= v;
+    }
+    acc ^= acc >> 32;
+    acc ^= acc >> 16;
+    acc ^= acc >> 8;
+    unsigned char x = acc;
+    for (; i < n; i++)
+        x ^= data[i];
+    return x;
+}
+
+// Ends the open COBS block at numOfBytes, with a FLAG implied after it
+// unless it is full, and opens the next one
+static int cobsNextBlock(struct frame* f, int numOfBytes){
+    f->data[f->code] = (numOfBytes - f->code) ^ FLAG;
+    f->code = numOfBytes;
+    return numOfBytes + 1;
+}
+
+// COBS counterpart of stuffBytes(). Runs without a FLAG are found with
+// memchr() and copied as they are; a FLAG costs the code byte of the next
+// block, never more. The room kept at the end covers BCC2 starting a new
+// block on its own.
+static int cobsBytes(struct frame* f, int* numOfBytes, const unsigned char* data, int len, unsigned char* bcc){
+    int n = *numOfBytes;
+    int used = 0;
+    if (f->code == 0)
+        f->code = n++;
+    while (used < len && n < FRAME_SIZE - 3){
+        if (n - f->code == COBS_BLOCK){
+            n = cobsNextBlock(f, n);
+            continue;
+        }
+        if (data[used] == FLAG){
+            *bcc ^= FLAG;
+            n = cobsNextBlock(f, n);
+            used++;
+            continue;
+        }
+        int run = len - used;
+        if (run > FRAME_SIZE - 3 - n)
+            run = FRAME_SIZE - 3 - n;
+        if (run > COBS_BLOCK - (n - f->code))
+            run = COBS_BLOCK - (n - f->code);
+        const unsigned char* flag = memchr(data + used, FLAG, run);
+        if (flag != NULL)
+            run = flag - (data + used);
+        memcpy(f->data + n, data + used, run);
+        *bcc ^= frameParity(data + used, run);
+        n += run;
+        used += run;
+        if (flag != NULL && n < FRAME_SIZE - 3){
+            *bcc ^= FLAG;
+            n = cobsNextBlock(f, n);
+            used++;
+        }
+    }
+    *numOfBytes = n;
+    return used;
+}
+
+// BCC2 goes through the encoder like data, then the last block is closed
+static void cobsClose(struct frame* f, int numOfBytes, unsigned char bcc){
+    if (f->code == 0)
+        f->code = numOfBytes++;
+    if (numOfBytes - f->code == COBS_BLOCK)
+        numOfBytes = cobsNextBlock(f, numOfBytes);
+    if (bcc == FLAG)
+        numOfBytes = cobsNextBlock(f, numOfBytes);
+    else
+        f->data[numOfBytes++] = bcc;
+    f->data[f->code] = (numOfBytes - f->code) ^ FLAG;
+    f->code = 0;
+    f->data[numOfBytes++] = FLAG;
+    frameFinish(f, numOfBytes);
+}
+
+// Puts as much of data as fits in the frame, in the agreed framing, and
+// folds it into bcc. Returns how many bytes went in.
+int frameStuff(struct frame* f, int* numOfBytes, const unsigned char* data, int len, unsigned char* bcc){
+    if (framing == FRAMING_COBS)
+        return cobsBytes(f, numOfBytes, data, len, bcc);
+    return stuffBytes(f, numOfBytes, data, len, bcc);
+}
+
+// Counts what stuffBytes() would take from data into a frame holding n bytes
+static int stuffSpan(int* n, const unsigned char* data, int len){
+    int used = 0;
+    while (used < len){
+        int run = len - used;
+        if (run > FRAME_SIZE - 3 - *n)
+            run = FRAME_SIZE - 3 - *n;
+        const unsigned char* flag = memchr(data + used, FLAG, run);
+        if (flag != NULL)
+            run = flag - (data + used);
+        const unsigned char* escape = memchr(data + used, ESCAPE, run);
+        if (escape != NULL)
+            run = escape - (data + used);
+        *n += run;
+        used += run;
+        if (used == len || *n + 2 > FRAME_SIZE - 3 || (flag == NULL && escape == NULL))
+            break;
+        *n += 2;
+        used++;
+    }
+    return used;
+}
+
+// Counts what cobsBytes() would take, making the same decisions without
+// writing anything
+static int cobsSpan(int* n, int* code, const unsigned char* data, int len){
+    int used = 0;
+    if (*code == 0)
+        *code = (*n)++;
+    while (used < len && *n < FRAME_SIZE - 3){
+        if (*n - *code == COBS_BLOCK || data[used] == FLAG){
+            used += data[used] == FLAG && *n - *code != COBS_BLOCK;
+            *code = (*n)++;
+            continue;
+        }
+        int run = len - used;
+        if (run > FRAME_SIZE - 3 - *n)
+            run = FRAME_SIZE - 3 - *n;
+        if (run > COBS_BLOCK - (*n - *code))
+            run = COBS_BLOCK - (*n - *code);
+        const unsigned char* flag = memchr(data + used, FLAG, run);
+        if (flag != NULL)
+            run = flag - (data + used);
+        *n += run;
+        used += run;
+        if (flag != NULL && *n < FRAME_SIZE - 3){
+            *code = (*n)++;
+            used++;
+        }
+    }
+    return used;
+}
+
+// How many bytes of data fit in one I-frame after the packet header head,
+// exactly as frameStuff() would cut them, but only scanning for the bytes
+// the framing treats specially. Lets a frame's input be fixed before it is
+// encoded, for encoding on another thread.
+int frameSpan(const unsigned char* head, int headLen, const unsigned char* data, int len){
+    int n = 4;
+    int code = 0;
+    if (framing == FRAMING_COBS){
+        cobsSpan(&n, &code, head, headLen);
+        return cobsSpan(&n, &code, data, len);
+    }
+    stuffSpan(&n, head, headLen);
+    return stuffSpan(&n, data, len);
+}
+
+// Appends BCC2 and the closing FLAG
+void frameClose(struct frame* f, int numOfBytes, unsigned char bcc){
+    if (framing == FRAMING_COBS)
+        cobsClose(f, numOfBytes, bcc);
+    else
+        closeStuffed(f, numOfBytes, bcc);
+}
+
+// Header of an I-frame from the sender, stamped at send time
+void frameInfoHeader(unsigned char buf[], int ns){
+    frameInfoHeaderAck(buf, A_SET, ns, -1);
+}
+
+// I-frame header from address a that also acknowledges everything before nr
+// of the other direction, or nothing when nr is -1. C and BCC1 have bit 7
+// set then, so the header still never needs stuffing.
+void frameInfoHeaderAck(unsigned char buf[], unsigned char a, int ns, int nr){
+    buf[0] = FLAG;
+    buf[1] = a;
+    buf[2] = nr < 0 ? C_I(ns) : C_I_ACK(ns, nr);
+    buf[3] = buf[1] ^ buf[2];
+}
+
+// Fills a frame with as much of information as fits, as a bare payload with
+// no packet type, and returns the number of bytes consumed
+int createInformationFrame(struct frame* frame, const unsigned char* information, int size){
+    int n = 4;
+    unsigned char bcc = 0x00;
+    frameInfoHeader(frame->data, 1);
+    int used = frameStuff(frame, &n, information, size, &bcc);
+    frameClose(frame, n, bcc);
+    frame->payload = used;
+    return used;
+}
+
+void frameSupervision(struct frame* f, unsigned char a, unsigned char c){
+    f->data[0] = FLAG;
+    f->data[1] = a;
+    f->data[2] = c;
+    f->data[3] = a ^ c;
+    f->data[4] = FLAG;
+    frameFinish(f, 5);
+}
+
+// Supervision frame with a data field in the agreed framing, such as the
+// credit of an RR
+void frameSupervisionData(struct frame* f, unsigned char a, unsigned char c, const unsigned char* data, int len){
+    int n = 4;
+    unsigned char bcc = 0x00;
+    f->data[0] = FLAG;
+    f->data[1] = a;
+    f->data[2] = c;
+    f->data[3] = a ^ c;
+    frameStuff(f, &n, data, len, &bcc);
+    frameClose(f, n, bcc);
+}
+
+// SET or UA with an option field. Options are always byte stuffed, since
+// they are what decides the framing.
+void frameOptions(struct frame* f, unsigned char a, unsigned char c, const unsigned char* options, int len){
+    int n = 4;
+    unsigned char bcc = 0x00;
+    f->data[0] = FLAG;
+    f->data[1] = a;
+    f->data[2] = c;
+    f->data[3] = a ^ c;
+    stuffBytes(f, &n, options, len, &bcc);
+    closeStuffed(f, n, bcc);
+}
+
+void framePoolReport(const char* who){
+    fprintf(stderr, "%s pool: acquires %ld, releases %ld, exhausted %ld\n",
+            who, poolStats.acquires, poolStats.releases, poolStats.exhausted);
+}
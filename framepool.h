@@ -0,0 +1,46 @@
+// Fixed-capacity pool of link frames shared by both endpoints
+//
+// Every frame that goes on the wire lives in one of these slots. The arena is
+// allocated once at start-up, so building a frame never touches the heap.
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#define FRAME_SIZE 500
+#define FRAME_POOL_CAPACITY 32 // the sender's ring, the encoder's jobs and the control frame
+
+struct frame {
+    unsigned char data[FRAME_SIZE];
+    int length;  // bytes in use, up to and including the closing FLAG
+    int payload; // file bytes carried (I-frames only)
+    int refs;    // 0 when the slot is free
+    int code;    // COBS: offset of the open block's code byte, 0 when none
+};
+
+struct poolStats {
+    long acquires;
+    long releases;
+    long exhausted;    // acquire calls that found no free slot
+};
+
+extern struct poolStats poolStats;
+
+int framePoolInit();
+struct frame* frameAcquire();
+void frameRelease(struct frame* f);
+void frameFinish(struct frame* f, int length);
+int frameStuff(struct frame* f, int* numOfBytes, const unsigned char* data, int len, unsigned char* bcc);
+void frameClose(struct frame* f, int numOfBytes, unsigned char bcc);
+int frameSpan(const unsigned char* head, int headLen, const unsigned char* data, int len);
+unsigned char frameParity(const unsigned char* data, int n);
+void frameInfoHeader(unsigned char buf[], int ns);
+void frameInfoHeaderAck(unsigned char buf[], unsigned char a, int ns, int nr);
+int createInformationFrame(struct frame* frame, const unsigned char* information, int size);
+void frameSupervision(struct frame* f, unsigned char a, unsigned char c);
+void frameSupervisionData(struct frame* f, unsigned char a, unsigned char c, const unsigned char* data, int len);
+void frameOptions(struct frame* f, unsigned char a, unsigned char c, const unsigned char* options, int len);
+void frameSetFraming(int framing);
+int frameFraming();
+void framePoolReport(const char* who);
+
+#endif
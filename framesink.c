@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framesink.h"
+#include "metrics.h"
+#include "probes.h"
+#include "realtime.h"
+
+static long long flushNs = 0;
+static int wantVmsplice = 0;
+static int streamFd = -1;
+
+// Reads DATALINK_FLUSH=<ms>, how long queued output may wait for more before
+// it is written (0, the default, writes it at once), and
+// DATALINK_VMSPLICE=<0|1>. Returns 0 when either cannot be parsed.
+int sinkConfigFromEnv(){
+    const char* want = getenv("DATALINK_FLUSH");
+    if (want != NULL && *want != '\0'){
+        char* end;
+        long ms = strtol(want, &end, 10);
+        if (*end != '\0' || ms < 0 || ms > SINK_FLUSH_MAX_MS){
+            printf("DATALINK_FLUSH must be 0 to %d ms, not %s\n", SINK_FLUSH_MAX_MS, want);
+            return 0;
+        }
+        flushNs = ms * 1000000LL;
+    }
+    want = getenv("DATALINK_VMSPLICE");
+    if (want != NULL && *want != '\0'){
+        if (strcmp(want, "0") != 0 && strcmp(want, "1") != 0){
+            printf("DATALINK_VMSPLICE must be 0 or 1, not %s\n", want);
+            return 0;
+        }
+        wantVmsplice = want[0] == '1';
+    }
+    return 1;
+}
+
+// Keeps the program's stdout for the data and points descriptor 1 at stderr,
+// so nothing printed from here on can end up in the stream. Programs writing
+// to "-" call it before their first diagnostic.
+int sinkClaimStdout(){
+    if (streamFd >= 0)
+        return 1;
+    fflush(stdout);
+    streamFd = dup(STDOUT_FILENO);
+    if (streamFd < 0)
+        return 0;
+    if (dup2(STDERR_FILENO, STDOUT_FILENO) < 0){
+        close(streamFd);
+        streamFd = -1;
+        return 0;
+    }
+    // Line by line, as stderr would be, so the two stay in order
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    return 1;
+}
+
+static struct timespec monotonicAt(long long ns){
+    struct timespec at = { ns / 1000000000LL, ns % 1000000000LL };
+    return at;
+}
+
+// Pages given to a pipe by vmsplice() stay the ring's until the consumer has
+// read them: what was handed over less what still sits unread is free again.
+// The pipe is looked at once every SINK_RECLAIM_MS at most.
+static void reclaim(struct frameSink* s){
+    int unread;
+    long long now = metricsNow();
+    if (!s->vmsplice || now - s->reclaimedAt < SINK_RECLAIM_MS * 1000000LL)
+        return;
+    s->reclaimedAt = now;
+    metricAdd(syscalls, 1);
+    if (ioctl(s->fd, FIONREAD, &unread) == 0 && s->written - unread > s->released)
+        s->released = s->written - unread;
+}
+
+// Nobody is woken when the consumer of a pipe reads, so with vmsplice a wait
+// for ring space is a short nap between looks at the pipe
+static void waitForSpace(struct frameSink* s){
+    if (!s->vmsplice){
+        pthread_cond_wait(&s->changed, &s->lock);
+        return;
+    }
+    reclaim(s);
+    if (s->tail - s->released < SINK_BUFFER_SIZE)
+        return;
+    struct timespec at = monotonicAt(metricsNow() + SINK_RECLAIM_MS * 1000000LL);
+    pthread_cond_timedwait(&s->changed, &s->lock, &at);
+}
+
+// Writer thread: drains the ring in order, one contiguous piece at a time
+static void* drain(void* arg){
+    struct frameSink* s = arg;
+    realtimeThread();
+    pthread_mutex_lock(&s->lock);
+    while (1){
+        while (s->head == s->tail && !s->closing)
+            pthread_cond_wait(&s->changed, &s->lock);
+        if (s->head == s->tail)
+            break;
+        // Under a flush policy, more output may join until a whole write's
+        // worth is queued or the oldest byte has waited long enough
+        while (flushNs > 0 && s->tail - s->head < SINK_WRITE_SIZE && !s->flushing && !s->closing){
+            long long due = s->since + flushNs;
+            if (metricsNow() >= due)
+                break;
+            struct timespec at = monotonicAt(due);
+            pthread_cond_timedwait(&s->changed, &s->lock, &at);
+        }
+        long long queuedAt = s->since;
+        int at = s->head % SINK_BUFFER_SIZE;
+        int n = s->tail - s->head;
+        if (n > SINK_BUFFER_SIZE - at)
+            n = SINK_BUFFER_SIZE - at;
+        if (n > SINK_WRITE_SIZE)
+            n = SINK_WRITE_SIZE;
+        pthread_mutex_unlock(&s->lock);
+
+        int done;
+        if (s->error)
+            done = n;
+        else if (s->vmsplice){
+            struct iovec piece = { s->buf + at, n };
+            done = vmsplice(s->fd, &piece, 1, 0);
+        }
+        else
+            done = write(s->fd, s->buf + at, n);
+        int failure = done < 0 ? errno : EIO;
+        metricAdd(syscalls, 1);
+
+        pthread_mutex_lock(&s->lock);
+        if (done < 0 && failure == EINTR)
+            continue;
+        if (done <= 0){
+            s->error = failure;
+            done = n;
+        }
+        else if (!s->error){
+            long long now = metricsNow();
+            s->written += done;
+            histogramRecord(&metrics.sinkDelay, now - queuedAt);
+            linkProbe3(sink_written, done, queuedAt, now);
+        }
+        s->head += done;
+        if (!s->vmsplice || s->error)
+            s->released = s->head;
+        pthread_cond_broadcast(&s->changed);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Without truncate an existing file keeps its contents, for repairs in place.
+// "-" is stdout, see sinkClaimStdout().
+int sinkOpen(struct frameSink* s, const char* name, int truncate){
+    s->head = 0;
+    s->tail = 0;
+    s->written = 0;
+    s->released = 0;
+    s->reclaimedAt = 0;
+    s->error = 0;
+    s->closing = 0;
+    s->flushing = 0;
+    if (strcmp(name, "-") == 0)
+        s->fd = sinkClaimStdout() ? streamFd : -1;
+    else
+        s->fd = open(name, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0644);
+    if (s->fd < 0)
+        return 0;
+
+    // A consumer that goes away shows up as EPIPE on the output instead of
+    // killing the link mid-transfer
+    struct stat st;
+    int isPipe = fstat(s->fd, &st) == 0 && S_ISFIFO(st.st_mode);
+    if (isPipe)
+        signal(SIGPIPE, SIG_IGN);
+    s->vmsplice = isPipe && wantVmsplice;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    if (pthread_create(&s->writer, NULL, drain, s) != 0){
+        close(s->fd);
+        return 0;
+    }
+    return 1;
+}
+
+// Waits until everything queued is in the kernel's hands
+int sinkFlush(struct frameSink* s){
+    pthread_mutex_lock(&s->lock);
+    s->flushing++;
+    pthread_cond_broadcast(&s->changed);
+    while (s->head != s->tail)
+        pthread_cond_wait(&s->changed, &s->lock);
+    s->flushing--;
+    int ok = !s->error;
+    pthread_mutex_unlock(&s->lock);
+    if (!ok)
+        errno = s->error;
+    return ok;
+}
+
+// The writer thread is idle once the ring is flushed, so the offset can move
+int sinkSeek(struct frameSink* s, long long offset){
+    if (!sinkFlush(s))
+        return 0;
+    metricAdd(syscalls, 1);
+    return lseek(s->fd, offset, SEEK_SET) == offset;
+}
+
+// Only waits when the ring is full, which flow control normally prevents.
+// While the writer thread is gathering output under a flush policy it is
+// only woken once there is a whole write's worth.
+int sinkWrite(struct frameSink* s, const unsigned char* data, int len){
+    pthread_mutex_lock(&s->lock);
+    int wasEmpty = s->head == s->tail;
+    if (wasEmpty)
+        s->since = metricsNow();
+    while (len > 0 && !s->error){
+        while (s->tail - s->released == SINK_BUFFER_SIZE && !s->error)
+            waitForSpace(s);
+        int at = s->tail % SINK_BUFFER_SIZE;
+        int n = SINK_BUFFER_SIZE - (s->tail - s->released);
+        if (n > SINK_BUFFER_SIZE - at)
+            n = SINK_BUFFER_SIZE - at;
+        if (n > len)
+            n = len;
+        memcpy(s->buf + at, data, n);
+        s->tail += n;
+        data += n;
+        len -= n;
+        if (wasEmpty || flushNs == 0 || s->tail - s->head >= SINK_WRITE_SIZE)
+            pthread_cond_signal(&s->changed);
+    }
+    int ok = !s->error;
+    pthread_mutex_unlock(&s->lock);
+    if (!ok)
+        errno = s->error;
+    return ok;
+}
+
+// Bytes queued that the output has not taken yet. With vmsplice that
+// includes what the consumer has still to read from the pipe, only looked up
+// past a quarter of the ring, well short of where flow control acts on it.
+long long sinkBacklog(struct frameSink* s){
+    pthread_mutex_lock(&s->lock);
+    if (s->tail - s->released > SINK_BUFFER_SIZE / 4)
+        reclaim(s);
+    long long backlog = s->tail - s->released;
+    pthread_mutex_unlock(&s->lock);
+    return backlog;
+}
+
+int sinkClose(struct frameSink* s){
+    int ok = sinkFlush(s);
+    pthread_mutex_lock(&s->lock);
+    s->closing = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->writer, NULL);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->changed);
+    if (s->fd == streamFd)
+        streamFd = -1;
+    if (close(s->fd) != 0)
+        ok = 0;
+    return ok;
+}
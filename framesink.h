@@ -0,0 +1,56 @@
+// Sequential output for the receiver
+//
+// Payloads are queued in one fixed ring and a writer thread puts them in the
+// file with write(), so a slow or stalled disk never holds up the link loop.
+// What is queued and not yet written is the backlog the receiver's flow
+// control looks at: it stops the sender with RNR before the ring fills.
+// Memory use does not depend on the size of the file. Offsets and counters
+// are 64-bit.
+//
+// The output can be "-", stdout, to stream into another program. The writer
+// thread hands bytes over as soon as they are queued, unless DATALINK_FLUSH
+// lets them gather for a few milliseconds to save system calls. On a pipe,
+// DATALINK_VMSPLICE=1 gives the ring's pages to the pipe instead of copying
+// them. Their ring space is only reused once FIONREAD shows the consumer has
+// read the bytes, so it is only safe for consumers that read() the pipe,
+// not for ones that splice() or tee() out of it.
+
+#ifndef FRAMESINK_H
+#define FRAMESINK_H
+
+#include <pthread.h>
+
+#define SINK_BUFFER_SIZE (1 << 20)
+#define SINK_WRITE_SIZE 65536 // most the writer thread hands to one write()
+#define SINK_FLUSH_MAX_MS 1000
+#define SINK_RECLAIM_MS 1      // how often a full ring looks at a vmsplice'd pipe again
+
+struct frameSink {
+    int fd;
+    unsigned char buf[SINK_BUFFER_SIZE];
+    long long head;    // bytes taken by the writer thread so far
+    long long tail;    // bytes queued so far, the backlog is tail - head
+    long long written; // bytes handed to the kernel so far
+    long long released; // ring space reusable up to here: head, or what the
+                        // consumer has read when pages went by vmsplice
+    long long since;   // metricsNow() when the oldest unwritten byte was queued
+    long long reclaimedAt;
+    int vmsplice;
+    int flushing;      // sinkFlush() is waiting, no batching
+    int error;         // errno of a failed write, the rest is dropped
+    int closing;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+int sinkConfigFromEnv();
+int sinkClaimStdout();
+int sinkOpen(struct frameSink* s, const char* name, int truncate);
+int sinkWrite(struct frameSink* s, const unsigned char* data, int len);
+int sinkFlush(struct frameSink* s);
+int sinkSeek(struct frameSink* s, long long offset);
+long long sinkBacklog(struct frameSink* s);
+int sinkClose(struct frameSink* s);
+
+#endif
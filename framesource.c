@@ -0,0 +1,83 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "framesource.h"
+#include "metrics.h"
+
+// "-" reads from stdin
+int sourceOpen(struct frameSource* s, const char* name){
+    memset(s, 0, sizeof(*s));
+    s->limit = -1;
+    if (strcmp(name, "-") == 0)
+        s->fd = STDIN_FILENO;
+    else
+        s->fd = open(name, O_RDONLY);
+    return s->fd >= 0;
+}
+
+// Tops up the buffer and returns how many bytes are ready. Without block it
+// only takes what the input already has, so a quiet pipe never stalls the
+// link while frames are in flight. While a whole frame's worth is buffered
+// it makes no system call at all.
+int sourceFill(struct frameSource* s, int block){
+    if (s->len - s->pos >= FRAME_SIZE)
+        return s->len - s->pos;
+    if (s->pos > 0){
+        memmove(s->buf, s->buf + s->pos, s->len - s->pos);
+        s->len -= s->pos;
+        s->pos = 0;
+    }
+    while (!s->eof && s->len < (int)sizeof(s->buf)){
+        int room = sizeof(s->buf) - s->len;
+        if (s->limit >= 0 && s->limit - s->len < room)
+            room = s->limit - s->len;
+        if (room == 0){
+            if (s->len == 0)
+                s->eof = 1;
+            break;
+        }
+        struct pollfd p = { .fd = s->fd, .events = POLLIN };
+        metricAdd(syscalls, 1);
+        if (poll(&p, 1, (block && s->len == 0) ? -1 : 0) <= 0)
+            break;
+        int n = read(s->fd, s->buf + s->len, room);
+        metricAdd(syscalls, 1);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0){
+            s->eof = 1;
+            break;
+        }
+        s->len += n;
+    }
+    return s->len - s->pos;
+}
+
+void sourceConsume(struct frameSource* s, int n){
+    s->pos += n;
+    s->total += n;
+    if (s->limit >= 0)
+        s->limit -= n;
+}
+
+// Restricts the input to [offset, offset + length) of a regular file
+int sourceSeek(struct frameSource* s, long long offset, long long length){
+    metricAdd(syscalls, 1);
+    if (lseek(s->fd, offset, SEEK_SET) < 0)
+        return 0;
+    s->pos = 0;
+    s->len = 0;
+    s->eof = 0;
+    s->limit = length;
+    return 1;
+}
+
+void sourceClose(struct frameSource* s){
+    if (s->fd > STDIN_FILENO)
+        close(s->fd);
+}
@@ -0,0 +1,30 @@
+// Sequential input for the sender
+//
+// Works the same on regular files, pipes, sockets and stdin: bytes are read
+// in order into a fixed buffer, and nothing depends on the size of the
+// input. Memory use is constant whatever the length of the stream.
+
+#ifndef FRAMESOURCE_H
+#define FRAMESOURCE_H
+
+#include "framepool.h"
+
+#define SOURCE_BUFFER_SIZE 65536 // one read serves a hundred frames or so
+
+struct frameSource {
+    int fd;
+    unsigned char buf[SOURCE_BUFFER_SIZE];
+    int pos;
+    int len;
+    int eof;         // end of the input, or of the range being sent
+    long long total; // bytes handed out so far
+    long long limit; // bytes left in the current range, -1 for no range
+};
+
+int sourceOpen(struct frameSource* s, const char* name);
+int sourceFill(struct frameSource* s, int block);
+void sourceConsume(struct frameSource* s, int n);
+int sourceSeek(struct frameSource* s, long long offset, long long length);
+void sourceClose(struct frameSource* s);
+
+#endif
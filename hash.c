@@ -0,0 +1,172 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <string.h>
+#include <unistd.h>
+
+#include "hash.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl(uint64_t x, int r){
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char* p){
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint32_t read32(const unsigned char* p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input){
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val){
+    acc ^= round64(0, val);
+    return acc * PRIME1 + PRIME4;
+}
+
+void xxh64Init(struct xxh64* h, uint64_t seed){
+    memset(h, 0, sizeof(*h));
+    h->seed = seed;
+    h->v[0] = seed + PRIME1 + PRIME2;
+    h->v[1] = seed + PRIME2;
+    h->v[2] = seed;
+    h->v[3] = seed - PRIME1;
+}
+
+// Four independent lanes per 32-byte stripe, so the compiler can keep them
+// all in flight at once
+void xxh64Update(struct xxh64* h, const void* data, int len){
+    const unsigned char* p = data;
+    const unsigned char* end = p + len;
+    h->total += len;
+
+    if (h->memSize + len < 32){
+        memcpy(h->mem + h->memSize, p, len);
+        h->memSize += len;
+        return;
+    }
+    if (h->memSize > 0){
+        int fill = 32 - h->memSize;
+        memcpy(h->mem + h->memSize, p, fill);
+        h->v[0] = round64(h->v[0], read64(h->mem));
+        h->v[1] = round64(h->v[1], read64(h->mem + 8));
+        h->v[2] = round64(h->v[2], read64(h->mem + 16));
+        h->v[3] = round64(h->v[3], read64(h->mem + 24));
+        p += fill;
+        h->memSize = 0;
+    }
+    uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+    while (p + 32 <= end){
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+    h->v[0] = v0; h->v[1] = v1; h->v[2] = v2; h->v[3] = v3;
+    if (p < end){
+        memcpy(h->mem, p, end - p);
+        h->memSize = end - p;
+    }
+}
+
+uint64_t xxh64Digest(const struct xxh64* h){
+    uint64_t acc;
+    if (h->total >= 32){
+        acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) + rotl(h->v[3], 18);
+        acc = merge64(acc, h->v[0]);
+        acc = merge64(acc, h->v[1]);
+        acc = merge64(acc, h->v[2]);
+        acc = merge64(acc, h->v[3]);
+    }
+    else
+        acc = h->seed + PRIME5;
+    acc += h->total;
+
+    const unsigned char* p = h->mem;
+    const unsigned char* end = p + h->memSize;
+    while (p + 8 <= end){
+        acc ^= round64(0, read64(p));
+        acc = rotl(acc, 27) * PRIME1 + PRIME4;
+        p += 8;
+    }
+    if (p + 4 <= end){
+        acc ^= (uint64_t)read32(p) * PRIME1;
+        acc = rotl(acc, 23) * PRIME2 + PRIME3;
+        p += 4;
+    }
+    while (p < end){
+        acc ^= (*p) * PRIME5;
+        acc = rotl(acc, 11) * PRIME1;
+        p++;
+    }
+    acc ^= acc >> 33;
+    acc *= PRIME2;
+    acc ^= acc >> 29;
+    acc *= PRIME3;
+    acc ^= acc >> 32;
+    return acc;
+}
+
+uint64_t xxh64(const void* data, int len, uint64_t seed){
+    struct xxh64 h;
+    xxh64Init(&h, seed);
+    xxh64Update(&h, data, len);
+    return xxh64Digest(&h);
+}
+
+void hasherInit(struct blockHasher* b){
+    xxh64Init(&b->whole, 0);
+    hasherStartBlock(b, 0);
+}
+
+void hasherStartBlock(struct blockHasher* b, long long blockIndex){
+    xxh64Init(&b->block, 0);
+    b->blockIndex = blockIndex;
+    b->blockFill = 0;
+}
+
+// Callers keep each update inside one block
+void hasherUpdate(struct blockHasher* b, const unsigned char* data, int len){
+    xxh64Update(&b->whole, data, len);
+    xxh64Update(&b->block, data, len);
+    b->blockFill += len;
+}
+
+int hasherBlockLeft(const struct blockHasher* b){
+    return HASH_BLOCK_SIZE - b->blockFill;
+}
+
+// Hashes a whole regular file from the start with pread, leaving its offset alone
+int hashFile(int fd, long long* size, uint64_t* hash){
+    unsigned char buf[65536];
+    struct xxh64 h;
+    long long offset = 0;
+    xxh64Init(&h, 0);
+    while (1){
+        int n = pread(fd, buf, sizeof(buf), offset);
+        if (n < 0)
+            return 0;
+        if (n == 0)
+            break;
+        xxh64Update(&h, buf, n);
+        offset += n;
+    }
+    *size = offset;
+    *hash = xxh64Digest(&h);
+    return 1;
+}
@@ -0,0 +1,43 @@
+// Streaming xxHash64 and per-block hashes for end-to-end verification
+//
+// Both endpoints hash the stream as it passes: the sender as it reads its
+// input, the receiver as it hands payloads to the sink. Hashes of fixed-size
+// blocks go along with the data, so a mismatch points at the blocks to
+// resend instead of the whole file.
+
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+#define HASH_BLOCK_SIZE (1 << 20)
+
+struct xxh64 {
+    uint64_t v[4];
+    uint64_t total;
+    unsigned char mem[32];
+    int memSize;
+    uint64_t seed;
+};
+
+void xxh64Init(struct xxh64* h, uint64_t seed);
+void xxh64Update(struct xxh64* h, const void* data, int len);
+uint64_t xxh64Digest(const struct xxh64* h);
+uint64_t xxh64(const void* data, int len, uint64_t seed);
+
+// Whole-stream hash plus the hash of the current block
+struct blockHasher {
+    struct xxh64 whole;
+    struct xxh64 block;
+    long long blockIndex;
+    int blockFill;
+};
+
+void hasherInit(struct blockHasher* b);
+void hasherStartBlock(struct blockHasher* b, long long blockIndex);
+void hasherUpdate(struct blockHasher* b, const unsigned char* data, int len);
+int hasherBlockLeft(const struct blockHasher* b);
+
+int hashFile(int fd, long long* size, uint64_t* hash);
+
+#endif
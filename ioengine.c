@@ -0,0 +1,580 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ioengine.h"
+#include "metrics.h"
+
+#define RING_ENTRIES 8
+#define SQPOLL_IDLE_MS 2000 // longer than a frame takes at the lowest baud rate
+#define SPIN_NS 50000       // sqpoll only: how long to watch the CQ before sleeping
+#define IO_CLOSE_WAIT_MS 1000 // a port that takes nothing for this long is given up on close
+
+#define POLL_TAG 0
+#define RX_TAG 1
+#define TX_TAG 2
+
+static int ringSetup(struct ioEngine* e, int sqpoll){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (sqpoll){
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    e->ring = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (e->ring < 0)
+        return 0;
+    // Waiting with a timeout is done with the EXT_ARG form of io_uring_enter
+    if (!(p.features & IORING_FEAT_EXT_ARG)){
+        errno = ENOSYS;
+        return 0;
+    }
+
+    e->sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    e->cqMapSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP){
+        if (e->cqMapSize > e->sqMapSize)
+            e->sqMapSize = e->cqMapSize;
+        e->cqMapSize = 0;
+    }
+    e->sqMap = mmap(NULL, e->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    e->ring, IORING_OFF_SQ_RING);
+    if (e->sqMap == MAP_FAILED){
+        e->sqMap = NULL;
+        return 0;
+    }
+    e->cqMap = e->sqMap;
+    if (e->cqMapSize > 0){
+        e->cqMap = mmap(NULL, e->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        e->ring, IORING_OFF_CQ_RING);
+        if (e->cqMap == MAP_FAILED){
+            e->cqMap = NULL;
+            return 0;
+        }
+    }
+    e->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    e->sqes = mmap(NULL, e->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   e->ring, IORING_OFF_SQES);
+    if (e->sqes == MAP_FAILED){
+        e->sqes = NULL;
+        return 0;
+    }
+
+    char* sq = e->sqMap;
+    char* cq = e->cqMap;
+    e->sqHead = (unsigned*)(sq + p.sq_off.head);
+    e->sqTail = (unsigned*)(sq + p.sq_off.tail);
+    e->sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+    e->sqFlags = (unsigned*)(sq + p.sq_off.flags);
+    e->sqArray = (unsigned*)(sq + p.sq_off.array);
+    e->cqHead = (unsigned*)(cq + p.cq_off.head);
+    e->cqTail = (unsigned*)(cq + p.cq_off.tail);
+    e->cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+    e->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    // Buffer 0 is rx, 1 the transmit queue; file 0 is the port
+    struct iovec buffers[2];
+    buffers[0].iov_base = e->rx;
+    buffers[0].iov_len = sizeof(e->rx);
+    buffers[1].iov_base = e->tx;
+    buffers[1].iov_len = sizeof(e->tx);
+    if (syscall(__NR_io_uring_register, e->ring, IORING_REGISTER_BUFFERS, buffers, 2) < 0)
+        return 0;
+    if (syscall(__NR_io_uring_register, e->ring, IORING_REGISTER_FILES, &e->fd, 1) < 0)
+        return 0;
+
+    // A tty read tried inline would sleep inside io_uring_enter, so the port
+    // is made non-blocking and every read is linked behind a poll instead
+    fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL, 0) | O_NONBLOCK);
+    e->kind = sqpoll ? IO_SQPOLL : IO_URING;
+    return 1;
+}
+
+static void ringFree(struct ioEngine* e){
+    if (e->sqes != NULL)
+        munmap(e->sqes, e->sqesSize);
+    if (e->cqMap != NULL && e->cqMap != e->sqMap)
+        munmap(e->cqMap, e->cqMapSize);
+    if (e->sqMap != NULL)
+        munmap(e->sqMap, e->sqMapSize);
+    if (e->ring >= 0)
+        close(e->ring);
+    e->sqes = NULL;
+    e->sqMap = e->cqMap = NULL;
+    e->ring = -1;
+}
+
+// Time one character takes on the line: start bit, data bits, parity and
+// stop bits at the output speed. 0 when the speed is not a standard one.
+static long long characterTime(int fd){
+    static const struct { speed_t code; int baud; } rates[] = {
+        { B1200, 1200 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 },
+        { B19200, 19200 }, { B38400, 38400 }, { B57600, 57600 },
+        { B115200, 115200 }, { B230400, 230400 }, { B460800, 460800 },
+    };
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return 0;
+    int bits = 1 + 8 + 1;
+    switch (tio.c_cflag & CSIZE){
+        case CS5: bits -= 3; break;
+        case CS6: bits -= 2; break;
+        case CS7: bits -= 1; break;
+    }
+    if (tio.c_cflag & PARENB)
+        bits++;
+    if (tio.c_cflag & CSTOPB)
+        bits++;
+    for (unsigned i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+        if (cfgetospeed(&tio) == rates[i].code)
+            return bits * 1000000000LL / rates[i].baud;
+    return 0;
+}
+
+// The port's blocking mode is remembered: ioRead() keeps to it whatever the
+// engine does with the descriptor underneath. Call it once termios is set,
+// so the drain estimate knows the line speed.
+int ioEngineInit(struct ioEngine* e, int fd){
+    memset(e, 0, sizeof(*e));
+    e->fd = fd;
+    e->epoll = -1;
+    e->ring = -1;
+    e->blocking = !(fcntl(fd, F_GETFL, 0) & O_NONBLOCK);
+    e->kind = IO_PLAIN;
+    e->nsPerByte = characterTime(fd);
+
+    const char* want = getenv("DATALINK_IO");
+    if (want == NULL || *want == '\0')
+        return 1;
+    if (strcmp(want, "uring") == 0 || strcmp(want, "sqpoll") == 0){
+        if (ringSetup(e, strcmp(want, "sqpoll") == 0))
+            return 1;
+        printf("io_uring unavailable (%s), using epoll\n", strerror(errno));
+        ringFree(e);
+    }
+    else if (strcmp(want, "epoll") != 0){
+        printf("DATALINK_IO must be uring, sqpoll or epoll, not %s\n", want);
+        return 0;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    e->epoll = epoll_create1(0);
+    if (e->epoll < 0 || epoll_ctl(e->epoll, EPOLL_CTL_ADD, fd, &ev) < 0){
+        perror("epoll");
+        return 0;
+    }
+    e->kind = IO_EPOLL;
+    return 1;
+}
+
+const char* ioEngineName(const struct ioEngine* e){
+    switch (e->kind){
+        case IO_EPOLL: return "epoll";
+        case IO_URING: return "io_uring";
+        case IO_SQPOLL: return "io_uring sqpoll";
+        default: return "read/write";
+    }
+}
+
+// On the ring only ioRead() needs to know; the port itself stays non-blocking
+void ioSetBlocking(struct ioEngine* e, int blocking){
+    e->blocking = blocking;
+    if (e->kind == IO_PLAIN || e->kind == IO_EPOLL){
+        int flags = fcntl(e->fd, F_GETFL, 0);
+        fcntl(e->fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    }
+}
+
+// Next free SQE, or NULL when the kernel has not taken the queued ones yet
+static struct io_uring_sqe* sqeGet(struct ioEngine* e){
+    unsigned tail = *e->sqTail;
+    if (tail - __atomic_load_n(e->sqHead, __ATOMIC_ACQUIRE) > *e->sqMask)
+        return NULL;
+    unsigned index = tail & *e->sqMask;
+    struct io_uring_sqe* sqe = &e->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    e->sqArray[index] = index;
+    return sqe;
+}
+
+static void sqePush(struct ioEngine* e){
+    __atomic_store_n(e->sqTail, *e->sqTail + 1, __ATOMIC_RELEASE);
+    e->unsubmitted++;
+}
+
+// Hands the queued SQEs to the kernel and, with wait, sleeps until at least
+// one completion is there or ms have gone by (forever when ms < 0). Under
+// sqpoll the kernel thread takes the SQEs itself, so without wait this is
+// normally no system call at all.
+static int ringEnter(struct ioEngine* e, int wait, int ms){
+    unsigned flags = 0;
+    unsigned submit = e->unsubmitted;
+    if (e->kind == IO_SQPOLL){
+        submit = 0;
+        e->unsubmitted = 0;
+        if (__atomic_load_n(e->sqFlags, __ATOMIC_ACQUIRE) & IORING_SQ_NEED_WAKEUP)
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        else if (!wait)
+            return 0;
+    }
+    else if (submit == 0 && !wait)
+        return 0;
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    void* argp = NULL;
+    size_t argSize = 0;
+    if (wait){
+        flags |= IORING_ENTER_GETEVENTS;
+        if (ms >= 0){
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (ms % 1000) * 1000000LL;
+            memset(&arg, 0, sizeof(arg));
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+            argp = &arg;
+            argSize = sizeof(arg);
+            flags |= IORING_ENTER_EXT_ARG;
+        }
+    }
+    int n = syscall(__NR_io_uring_enter, e->ring, submit, wait ? 1 : 0, flags, argp, argSize);
+    metricAdd(syscalls, 1);
+    if (n > 0 && e->kind != IO_SQPOLL)
+        e->unsubmitted -= n;
+    return n;
+}
+
+// Queues a poll for events on the port, linked to the SQE that follows it.
+// Only a failed poll produces a completion.
+static struct io_uring_sqe* postPoll(struct ioEngine* e, unsigned events){
+    if (*e->sqTail - __atomic_load_n(e->sqHead, __ATOMIC_ACQUIRE) + 2 > *e->sqMask + 1)
+        return NULL;
+    struct io_uring_sqe* sqe = sqeGet(e);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    sqe->fd = 0;
+    sqe->poll32_events = events;
+    sqe->user_data = POLL_TAG;
+    sqePush(e);
+    return sqeGet(e);
+}
+
+static void postRead(struct ioEngine* e){
+    struct io_uring_sqe* sqe = postPoll(e, POLLIN);
+    if (sqe == NULL)
+        return; // posted on the next call, once the kernel has made room
+    sqe->opcode = IORING_OP_READ_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)e->rx;
+    sqe->len = sizeof(e->rx);
+    sqe->buf_index = 0;
+    sqe->user_data = RX_TAG;
+    sqePush(e);
+    e->rxPosted = 1;
+}
+
+// Posts everything queued as one write, behind a poll for room in the
+// output queue when the last try found it full
+static void postWrite(struct ioEngine* e){
+    struct io_uring_sqe* sqe = e->txFull ? postPoll(e, POLLOUT) : sqeGet(e);
+    if (sqe == NULL)
+        return;
+    e->txPosted = e->txTail - e->txHead;
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->off = (uint64_t)-1;
+    sqe->addr = (uint64_t)(uintptr_t)(e->tx + e->txHead);
+    sqe->len = e->txPosted;
+    sqe->buf_index = 1;
+    sqe->user_data = TX_TAG;
+    sqePush(e);
+}
+
+// Takes n bytes off the front of the queue
+static void txSent(struct ioEngine* e, int n){
+    e->txHead += n;
+    if (e->txHead == e->txTail)
+        e->txHead = e->txTail = 0;
+}
+
+// Collects every completion: a finished read is kept for ioRead(), a
+// finished write takes its bytes off the queue and posts what is left
+static void reap(struct ioEngine* e){
+    unsigned head = *e->cqHead;
+    unsigned tail = __atomic_load_n(e->cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++){
+        struct io_uring_cqe* cqe = &e->cqes[head & *e->cqMask];
+        if (cqe->user_data == POLL_TAG)
+            continue; // its linked operation completes with -ECANCELED
+        if (cqe->user_data == RX_TAG){
+            e->rxPosted = 0;
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN || cqe->res == -ECANCELED)
+                continue;
+            e->rxReady = 1;
+            e->rxResult = cqe->res;
+            continue;
+        }
+        int posted = e->txPosted;
+        e->txPosted = 0;
+        e->txFull = cqe->res == -EAGAIN || cqe->res == -ECANCELED ||
+                    (cqe->res > 0 && cqe->res < posted);
+        if (cqe->res < 0 && cqe->res != -EINTR && !e->txFull)
+            e->error = -cqe->res;
+        else if (cqe->res > 0)
+            txSent(e, cqe->res);
+        if (e->error == 0 && e->txHead < e->txTail)
+            postWrite(e);
+    }
+    __atomic_store_n(e->cqHead, head, __ATOMIC_RELEASE);
+    if (!e->rxPosted && !e->rxReady)
+        postRead(e);
+}
+
+// Waits up to ms for room in the kernel's output queue and hands it what
+// fits. Returns 1 if some of the queue went out, 0 if none did. Only used
+// on close: while the link runs, a full queue is waited on in ioWait(),
+// where the replies keep being read.
+static int txWait(struct ioEngine* e, int ms){
+    int queued = e->txTail - e->txHead;
+    if (e->kind == IO_URING || e->kind == IO_SQPOLL){
+        if (e->txPosted == 0)
+            postWrite(e);
+        if (ringEnter(e, 1, ms) < 0 && errno != EINTR && errno != ETIME)
+            return 0;
+        reap(e);
+    }
+    else {
+        struct pollfd p = { .fd = e->fd, .events = POLLOUT };
+        metricAdd(syscalls, 1);
+        if (poll(&p, 1, ms) < 0 && errno != EINTR)
+            return 0;
+        ioFlush(e);
+    }
+    return e->error == 0 && e->txTail - e->txHead < queued;
+}
+
+// Adds a frame to the transmit queue without writing anything yet. If it
+// does not fit even after pushing what the port takes now, it fails with
+// EAGAIN and the caller tries again after ioWait().
+int ioQueuev(struct ioEngine* e, const struct iovec* iov, int count){
+    int len = 0;
+    for (int i = 0; i < count; i++)
+        len += iov[i].iov_len;
+    if (len > IO_QUEUE_SIZE){
+        errno = EMSGSIZE;
+        return -1;
+    }
+    while (e->txTail + len > IO_QUEUE_SIZE){
+        // Bytes already in a posted write cannot move
+        if (e->txHead > 0 && e->txPosted == 0){
+            memmove(e->tx, e->tx + e->txHead, e->txTail - e->txHead);
+            e->txTail -= e->txHead;
+            e->txHead = 0;
+            continue;
+        }
+        int queued = e->txTail - e->txHead;
+        if (ioFlush(e) < 0)
+            return -1;
+        if (e->txTail - e->txHead == queued){
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; i++){
+        memcpy(e->tx + e->txTail, iov[i].iov_base, iov[i].iov_len);
+        e->txTail += iov[i].iov_len;
+    }
+    return len;
+}
+
+// Puts the queue on the wire with one write. What the port does not take
+// now is left queued for ioWait(). Returns the bytes still queued.
+int ioFlush(struct ioEngine* e){
+    if (e->kind == IO_URING || e->kind == IO_SQPOLL){
+        reap(e);
+        if (e->txPosted == 0 && e->txHead < e->txTail)
+            postWrite(e);
+        ringEnter(e, 0, 0);
+    }
+    else while (e->txHead < e->txTail){
+        int n = write(e->fd, e->tx + e->txHead, e->txTail - e->txHead);
+        metricAdd(syscalls, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n < 0)
+            e->error = errno;
+        if (n <= 0)
+            break;
+        int partial = n < e->txTail - e->txHead;
+        txSent(e, n);
+        if (partial)
+            break; // the port is full, a second try would only get EAGAIN
+    }
+    if (e->error != 0){
+        errno = e->error;
+        return -1;
+    }
+    return e->txTail - e->txHead;
+}
+
+int ioWritev(struct ioEngine* e, const struct iovec* iov, int count){
+    int len = ioQueuev(e, iov, count);
+    if (len < 0 || ioFlush(e) < 0)
+        return -1;
+    return len;
+}
+
+int ioWrite(struct ioEngine* e, const void* data, int len){
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+    return ioWritev(e, &iov, 1);
+}
+
+// Estimates how long until the last queued byte has left the wire: what the
+// engine still holds plus what the driver reports in its output buffer
+// (TIOCOUTQ), at the line's character time
+long long ioDrainTime(struct ioEngine* e){
+    int outq = 0;
+    metricAdd(syscalls, 1);
+    if (ioctl(e->fd, TIOCOUTQ, &outq) < 0)
+        outq = 0;
+    return (long long)(e->txTail - e->txHead + outq) * e->nsPerByte;
+}
+
+// Same contract as read(2) on the port: on a non-blocking port it fails with
+// EAGAIN when nothing has arrived. On the ring the read is re-posted straight
+// away, and goes to the kernel with the next write or wait.
+int ioRead(struct ioEngine* e, unsigned char* buf, int len){
+    if (e->kind == IO_PLAIN || e->kind == IO_EPOLL){
+        metricAdd(syscalls, 1);
+        return read(e->fd, buf, len);
+    }
+    while (1){
+        reap(e);
+        if (e->rxReady){
+            int n = e->rxResult;
+            e->rxReady = 0;
+            postRead(e);
+            if (n < 0){
+                errno = -n;
+                return -1;
+            }
+            if (n > len)
+                n = len;
+            memcpy(buf, e->rx, n);
+            return n;
+        }
+        if (!e->blocking){
+            errno = EAGAIN;
+            return -1;
+        }
+        if (ringEnter(e, 1, -1) < 0 && errno != ETIME)
+            return -1;
+    }
+}
+
+// Returns 1 when ioRead() has bytes to give, 0 after ms without any
+static int ringWait(struct ioEngine* e, int ms){
+    reap(e);
+    if (e->rxReady)
+        return 1;
+    if (e->kind == IO_SQPOLL){
+        // The reply is often only microseconds away; catch it without sleeping
+        struct timespec start, now;
+        ringEnter(e, 0, 0);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        do {
+            if (__atomic_load_n(e->cqTail, __ATOMIC_ACQUIRE) != *e->cqHead){
+                reap(e);
+                if (e->rxReady)
+                    return 1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &now);
+        } while ((now.tv_sec - start.tv_sec) * 1000000000LL + now.tv_nsec - start.tv_nsec < SPIN_NS);
+    }
+    if (ringEnter(e, 1, ms) < 0 && errno != ETIME && errno != EINTR)
+        return -1;
+    reap(e);
+    return e->rxReady;
+}
+
+// Waits up to ms for the port to have bytes. While the transmit queue
+// holds bytes the port would not take, room in the port flushes them.
+static int portWait(struct ioEngine* e, int ms){
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int left = ms;
+    while (1){
+        int out = e->txHead < e->txTail;
+        unsigned events;
+        int n;
+        if (e->kind == IO_EPOLL){
+            struct epoll_event ev = { .events = EPOLLIN | (out ? EPOLLOUT : 0) };
+            if (out != e->epollOut){
+                epoll_ctl(e->epoll, EPOLL_CTL_MOD, e->fd, &ev);
+                metricAdd(syscalls, 1);
+                e->epollOut = out;
+            }
+            n = epoll_wait(e->epoll, &ev, 1, left);
+            events = ev.events;
+        }
+        else {
+            struct pollfd p = { .fd = e->fd, .events = POLLIN | (out ? POLLOUT : 0) };
+            n = poll(&p, 1, left);
+            events = p.revents;
+        }
+        metricAdd(syscalls, 1);
+        if (n <= 0)
+            return n;
+        if (events & POLLOUT)
+            ioFlush(e);
+        if (events & (POLLIN | POLLERR | POLLHUP))
+            return 1;
+        if (ms >= 0){
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            left = ms - (int)((now.tv_sec - start.tv_sec) * 1000 +
+                              (now.tv_nsec - start.tv_nsec) / 1000000);
+            if (left <= 0)
+                return 0;
+        }
+    }
+}
+
+int ioWait(struct ioEngine* e, int ms){
+    if (e->kind == IO_PLAIN || e->kind == IO_EPOLL)
+        return portWait(e, ms);
+    return ringWait(e, ms);
+}
+
+// Waits until the queue has reached the port and the port has put the last
+// byte on the wire (tcdrain), then gives the descriptor back as it was
+void ioEngineClose(struct ioEngine* e){
+    while (ioFlush(e) > 0 && txWait(e, IO_CLOSE_WAIT_MS))
+        ;
+    metricAdd(syscalls, 1);
+    tcdrain(e->fd);
+    if (e->ring >= 0){
+        ringFree(e);
+        if (e->blocking)
+            fcntl(e->fd, F_SETFL, fcntl(e->fd, F_GETFL, 0) & ~O_NONBLOCK);
+    }
+    if (e->epoll >= 0)
+        close(e->epoll);
+    e->epoll = -1;
+    e->kind = IO_PLAIN;
+}
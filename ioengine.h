@@ -0,0 +1,95 @@
+// Serial port I/O engine shared by both endpoints
+//
+// The link loops only ever write whole frames and wait for bytes with a
+// deadline. This puts those two operations behind one interface with four
+// implementations, picked at start-up from DATALINK_IO:
+//
+//   (unset)  read/write/poll, as the programs always did
+//   epoll    read/write with the port registered once in an epoll set
+//   uring    io_uring with the port and its buffers registered up front: a
+//            read is always posted, and submitting the next one and waiting
+//            for the reply are the same system call
+//   sqpoll   uring with a kernel thread polling the submission queue, so
+//            writes and re-posted reads cost no system call at all
+//
+// When the kernel refuses io_uring the engine says so and falls back to epoll.
+//
+// Writes go through a transmit queue. Frames can be queued and put on the
+// wire together, and whatever the port does not take at once (a partial
+// write, EAGAIN) stays queued and is pushed out when the port reports room,
+// while the caller waits for its reply. A frame that finds the queue full
+// is refused with EAGAIN instead of blocking the link loop; a refused
+// supervision frame is as good as lost on the line.
+
+#ifndef IOENGINE_H
+#define IOENGINE_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "framepool.h"
+
+enum ioKind {
+    IO_PLAIN,
+    IO_EPOLL,
+    IO_URING,
+    IO_SQPOLL
+};
+
+#define IO_QUEUE_SIZE (8 * FRAME_SIZE)
+
+struct ioEngine {
+    int kind;
+    int fd;
+    int blocking;      // as the port was opened; the ring itself never blocks on it
+    int epoll;
+    int epollOut;      // EPOLLOUT is in the set while the queue has bytes
+    long long nsPerByte; // time one character takes on the line, from termios
+
+    // Ring mappings, uring and sqpoll only
+    int ring;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqFlags;
+    unsigned* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    size_t sqesSize;
+    unsigned unsubmitted;  // SQEs queued since the last io_uring_enter
+
+    // The posted read lands in rx. Bytes [txHead, txTail) of tx wait for the
+    // port; on the ring the first txPosted of them are in the write being
+    // served, so at most one write is out and bytes keep their order.
+    int rxPosted;
+    int rxReady;
+    int rxResult;          // bytes of the finished read, or -errno
+    int txHead;
+    int txTail;
+    int txPosted;
+    int txFull;            // the last write found the output queue full
+    int error;             // errno of a failed write
+    unsigned char rx[FRAME_SIZE];
+    unsigned char tx[IO_QUEUE_SIZE];
+};
+
+int ioEngineInit(struct ioEngine* e, int fd);
+const char* ioEngineName(const struct ioEngine* e);
+void ioSetBlocking(struct ioEngine* e, int blocking);
+int ioQueuev(struct ioEngine* e, const struct iovec* iov, int count);
+int ioFlush(struct ioEngine* e);
+int ioWrite(struct ioEngine* e, const void* data, int len);
+int ioWritev(struct ioEngine* e, const struct iovec* iov, int count);
+long long ioDrainTime(struct ioEngine* e);
+int ioRead(struct ioEngine* e, unsigned char* buf, int len);
+int ioWait(struct ioEngine* e, int ms);
+void ioEngineClose(struct ioEngine* e);
+
+#endif
@@ -0,0 +1,50 @@
+// Writes the delta signature of a file the receiving station already holds
+//
+// Usage: makesignature <basis> <signature> [blocksize]
+// Bring the signature to the sending station (it is just a file, so it can
+// go over the link itself) and run write_datalink --delta <signature>.
+//
+// Build: gcc -o makesignature makesignature.c delta.c hash.c
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "delta.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Incorrect program usage\n"
+               "Usage: %s <basis> <signature> [blocksize]\n"
+               "Example: %s firmware-old.bin firmware.sig\n",
+               argv[0],
+               argv[0]);
+        exit(1);
+    }
+
+    int blockSize = argc > 3 ? atoi(argv[3]) : DELTA_BLOCK_SIZE;
+    int basis = open(argv[1], O_RDONLY);
+    if (basis < 0 || blockSize <= 0 || blockSize > DELTA_MAX_BLOCK_SIZE)
+    {
+        perror(argv[1]);
+        exit(-1);
+    }
+    FILE* out = fopen(argv[2], "wb");
+    if (out == NULL)
+    {
+        perror(argv[2]);
+        exit(-1);
+    }
+
+    if (!signatureWrite(basis, blockSize, out))
+    {
+        printf("error: cannot write signature %s\n", argv[2]);
+        exit(-1);
+    }
+    fclose(out);
+    close(basis);
+    return 0;
+}
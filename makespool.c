@@ -0,0 +1,144 @@
+// Pre-encodes a file into a spool of ready-to-send I-frames
+//
+// Usage: makespool <file> <spool>
+// The frames carry the same packets write_datalink would build live: DATA,
+// a BLOCKHASH after every block and END. Send them with
+// write_datalink <SerialPort> <file> --spool <spool>.
+//
+// Build: gcc -o makespool makespool.c framepool.c framesource.c hash.c spool.c metrics.c
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "framepool.h"
+#include "framesource.h"
+#include "hash.h"
+#include "packet.h"
+#include "protocol.h"
+#include "spool.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3)
+    {
+        printf("Incorrect program usage\n"
+               "Usage: %s <file> <spool>\n"
+               "Example: %s firmware.bin firmware.spool\n",
+               argv[0],
+               argv[0]);
+        exit(1);
+    }
+
+    struct frameSource src;
+    struct stat before, after;
+    if (!sourceOpen(&src, argv[1]) || fstat(src.fd, &before) < 0 || !S_ISREG(before.st_mode))
+    {
+        printf("error: cannot spool %s, it must be a regular file\n", argv[1]);
+        exit(-1);
+    }
+    FILE* out = fopen(argv[2], "wb");
+    FILE* index = tmpfile();
+    if (out == NULL || index == NULL || !framePoolInit())
+    {
+        perror(argv[2]);
+        exit(-1);
+    }
+
+    unsigned char header[SPOOL_HEADER_SIZE] = {0};
+    unsigned char offset[8];
+    long long position = SPOOL_HEADER_SIZE;
+    long long count = 0;
+    struct blockHasher hasher;
+    int hashPending = 0;
+    int done = 0;
+    struct frame* f = frameAcquire();
+    hasherInit(&hasher);
+    fwrite(header, 1, sizeof(header), out);
+
+    while (!done)
+    {
+        int numOfBytes = 4;
+        unsigned char bcc = 0x00;
+        unsigned char packet[FRAME_SIZE];
+        int packetSize = 0;
+        int available = hashPending ? 0 : sourceFill(&src, 1);
+        if (available > hasherBlockLeft(&hasher))
+            available = hasherBlockLeft(&hasher);
+
+        // Placeholder header, write_datalink stamps the real one
+        f->data[0] = FLAG;
+        f->data[1] = A_SET;
+        f->data[2] = C_I_NS0;
+        f->data[3] = A_SET ^ C_I_NS0;
+
+        if (available > 0)
+        {
+            int used;
+            packetSize = packetData(packet, src.buf + src.pos, available, &used);
+            hasherUpdate(&hasher, src.buf + src.pos, used);
+            sourceConsume(&src, used);
+            hashPending = hasherBlockLeft(&hasher) == 0;
+        }
+        else if (hashPending || hasher.blockFill > 0)
+        {
+            packet[0] = PKT_BLOCKHASH;
+            putU64(packet + 1, hasher.blockIndex);
+            putU64(packet + 9, xxh64Digest(&hasher.block));
+            hasherStartBlock(&hasher, hasher.blockIndex + 1);
+            packetSize = PKT_BLOCKHASH_SIZE;
+            hashPending = 0;
+        }
+        else
+        {
+            packetSize = packetEnd(packet, src.total, xxh64Digest(&hasher.whole));
+            done = 1;
+        }
+        // Encoded as encodePacket() does for a live transfer
+        frameStuff(f, &numOfBytes, packet, packetSize, &bcc);
+        frameClose(f, numOfBytes, bcc);
+
+        fwrite(f->data, 1, f->length, out);
+        putU64(offset, position);
+        fwrite(offset, 1, sizeof(offset), index);
+        position += f->length;
+        count++;
+    }
+    putU64(offset, position);
+    fwrite(offset, 1, sizeof(offset), index);
+
+    // The spool is only valid for the version of the file that was read
+    if (fstat(src.fd, &after) < 0 || after.st_size != src.total ||
+        after.st_mtim.tv_sec != before.st_mtim.tv_sec || after.st_mtim.tv_nsec != before.st_mtim.tv_nsec)
+    {
+        printf("error: %s changed while it was being spooled\n", argv[1]);
+        remove(argv[2]);
+        exit(-1);
+    }
+
+    rewind(index);
+    for (long long i = 0; i <= count; i++)
+    {
+        if (fread(offset, 1, sizeof(offset), index) != sizeof(offset))
+            break;
+        fwrite(offset, 1, sizeof(offset), out);
+    }
+    spoolHeader(header, &after, xxh64Digest(&hasher.whole), count, position);
+    rewind(out);
+    fwrite(header, 1, sizeof(header), out);
+    if (ferror(out) || fclose(out) != 0)
+    {
+        perror(argv[2]);
+        remove(argv[2]);
+        exit(-1);
+    }
+
+    printf("%lld bytes in %lld frames, %lld bytes of spool\n", src.total, count,
+           position + (count + 1) * 8);
+    frameRelease(f);
+    fclose(index);
+    sourceClose(&src);
+    return 0;
+}
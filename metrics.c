@@ -0,0 +1,148 @@
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+struct metrics metrics;
+
+static const char* program = "";
+static const char* mode = "normal";
+static volatile sig_atomic_t dumpRequested = 0;
+
+long long metricsNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int bucketOf(unsigned long long v){
+    if (v < 2 * HIST_SUB_BUCKETS)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((v >> shift) - HIST_SUB_BUCKETS);
+}
+
+// Lowest value that falls in bucket i
+static unsigned long long bucketValue(int i){
+    if (i < 2 * HIST_SUB_BUCKETS)
+        return i;
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    return (unsigned long long)(HIST_SUB_BUCKETS + i % HIST_SUB_BUCKETS) << shift;
+}
+
+void histogramRecord(struct histogram* h, long long ns){
+    unsigned long long v = ns < 0 ? 0 : ns;
+    unsigned long long seen;
+    atomic_fetch_add_explicit(&h->buckets[bucketOf(v)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, v, memory_order_relaxed);
+    seen = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (v > seen && !atomic_compare_exchange_weak_explicit(&h->max, &seen, v,
+                                                              memory_order_relaxed, memory_order_relaxed));
+    seen = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (v < seen && !atomic_compare_exchange_weak_explicit(&h->min, &seen, v,
+                                                              memory_order_relaxed, memory_order_relaxed));
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+}
+
+unsigned long long histogramPercentile(const struct histogram* h, double percentile){
+    unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long long target = (unsigned long long)(count * percentile / 100.0 + 0.5);
+    unsigned long long seen = 0;
+    if (count == 0)
+        return 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++){
+        seen += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        if (seen >= target)
+            return bucketValue(i);
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static void requestDump(int signal){
+    dumpRequested = 1;
+}
+
+// No SA_RESTART, so a blocking read on the port returns and the main loop
+// gets to metricsPoll() right away
+void metricsInit(const char* who){
+    struct sigaction action;
+    program = who;
+    atomic_store(&metrics.ackLatency.min, ULLONG_MAX);
+    atomic_store(&metrics.processing.min, ULLONG_MAX);
+    atomic_store(&metrics.turnaround.min, ULLONG_MAX);
+    atomic_store(&metrics.wakeLate.min, ULLONG_MAX);
+    atomic_store(&metrics.sinkDelay.min, ULLONG_MAX);
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestDump;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+}
+
+// Scheduling the numbers were taken under, for comparing runs
+void metricsMode(const char* description){
+    mode = description;
+}
+
+// JSON is written from the main loop, never from the signal handler
+void metricsPoll(){
+    if (dumpRequested){
+        dumpRequested = 0;
+        metricsDump(stderr);
+    }
+}
+
+static long long load(atomic_llong* counter){
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void dumpHistogram(FILE* out, const char* name, const struct histogram* h){
+    unsigned long long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long long sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+    fprintf(out, "\"%s\":{\"count\":%llu,\"min\":%llu,\"mean\":%llu,\"p50\":%llu,"
+            "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+            name, count,
+            count > 0 ? atomic_load_explicit(&h->min, memory_order_relaxed) : 0,
+            count > 0 ? sum / count : 0,
+            histogramPercentile(h, 50), histogramPercentile(h, 90),
+            histogramPercentile(h, 99), histogramPercentile(h, 99.9),
+            atomic_load_explicit(&h->max, memory_order_relaxed));
+}
+
+void metricsDump(FILE* out){
+    long long sent = load(&metrics.framesSent);
+    long long received = load(&metrics.framesReceived);
+    long long wireOut = load(&metrics.wireBytesOut);
+    long long wireIn = load(&metrics.wireBytesIn);
+    long long payloadOut = load(&metrics.payloadBytesOut);
+    long long payloadIn = load(&metrics.payloadBytesIn);
+    long long syscalls = load(&metrics.syscalls);
+
+    fprintf(out, "{\"program\":\"%s\",\"mode\":\"%s\",", program, mode);
+    fprintf(out, "\"frames\":{\"sent\":%lld,\"received\":%lld,\"rejected\":%lld,"
+            "\"duplicates\":%lld,\"reordered\":%lld,\"piggybacked\":%lld,\"not_ready\":%lld,\"retransmitted\":%lld,\"timeouts\":%lld},",
+            sent, received, load(&metrics.framesRejected), load(&metrics.duplicates), load(&metrics.reordered),
+            load(&metrics.piggybacked), load(&metrics.notReady), load(&metrics.retransmissions), load(&metrics.timeouts));
+    fprintf(out, "\"bytes\":{\"wire_out\":%lld,\"payload_out\":%lld,\"wire_in\":%lld,"
+            "\"payload_in\":%lld,\"overhead_out\":%.4f,\"overhead_in\":%.4f},",
+            wireOut, payloadOut, wireIn, payloadIn,
+            payloadOut > 0 ? (double)wireOut / payloadOut : 0.0,
+            payloadIn > 0 ? (double)wireIn / payloadIn : 0.0);
+    fprintf(out, "\"syscalls\":{\"total\":%lld,\"per_frame\":%.2f},", syscalls,
+            sent + received > 0 ? (double)syscalls / (sent + received) : 0.0);
+    fprintf(out, "\"latency_ns\":{");
+    dumpHistogram(out, "send_to_ack", &metrics.ackLatency);
+    fprintf(out, ",");
+    dumpHistogram(out, "processing", &metrics.processing);
+    fprintf(out, ",");
+    dumpHistogram(out, "arrival_to_reply", &metrics.turnaround);
+    fprintf(out, ",");
+    dumpHistogram(out, "wake_late", &metrics.wakeLate);
+    fprintf(out, ",");
+    dumpHistogram(out, "queued_to_written", &metrics.sinkDelay);
+    fprintf(out, "}}\n");
+    fflush(out);
+}
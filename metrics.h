@@ -0,0 +1,62 @@
+// Counters and latency histograms for both endpoints
+//
+// Everything is a relaxed atomic, so recording never takes a lock and a
+// reader never sees a torn value. Send SIGUSR1 for a JSON snapshot on stderr
+// while a transfer runs; the programs print a final one at exit.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+// Log-linear buckets as in HdrHistogram: values below 2 * HIST_SUB_BUCKETS
+// are exact, above that every power of two is split into HIST_SUB_BUCKETS,
+// so a bucket is never wider than about 3% of its value
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    atomic_ullong count;
+    atomic_ullong sum;
+    atomic_ullong min;
+    atomic_ullong max;
+    atomic_ullong buckets[HIST_BUCKETS];
+};
+
+struct metrics {
+    atomic_llong framesSent;      // including retransmissions
+    atomic_llong framesReceived;  // every frame the parser completed
+    atomic_llong framesRejected;  // REJ or SREJ sent or received
+    atomic_llong duplicates;
+    atomic_llong reordered;       // frames held in the reorder buffer until a gap filled
+    atomic_llong piggybacked;     // RR left out because an I-frame carried its N(R)
+    atomic_llong notReady;        // RNR sent or received
+    atomic_llong retransmissions;
+    atomic_llong timeouts;
+    atomic_llong wireBytesOut;
+    atomic_llong wireBytesIn;
+    atomic_llong payloadBytesOut; // file bytes
+    atomic_llong payloadBytesIn;
+    atomic_llong syscalls;        // read, write, poll and seek on the port and the file
+    struct histogram ackLatency;  // ns from sending an I-frame to its RR
+    struct histogram processing;  // ns spent encoding or handling one frame
+    struct histogram turnaround;  // ns from reading a frame's bytes to writing its reply
+    struct histogram wakeLate;    // ns a timed wait on the port overran its deadline
+    struct histogram sinkDelay;   // ns from queuing output to its write, from the oldest byte in it
+};
+
+extern struct metrics metrics;
+
+#define metricAdd(counter, n) atomic_fetch_add_explicit(&metrics.counter, (n), memory_order_relaxed)
+
+long long metricsNow();
+void histogramRecord(struct histogram* h, long long ns);
+unsigned long long histogramPercentile(const struct histogram* h, double percentile);
+void metricsInit(const char* who);
+void metricsMode(const char* description);
+void metricsPoll();
+void metricsDump(FILE* out);
+
+#endif
@@ -0,0 +1,77 @@
+// Application packets carried in the payload of I-frames
+//
+//   DATA      | bytes...
+//   END       | total bytes (8) | xxHash64 of the whole stream (8)
+//   SEEK      | offset (8)                 following DATA goes there
+//   BLOCKHASH | block index (8) | xxHash64 of the block (8)
+//   COPY      | basis offset (8) | length (4)   bytes the receiver already has,
+//                                              at most PKT_COPY_MAX of them
+//
+// Numbers are big endian. END marks the end of the stream, so the sender
+// never needs to know the size of its input up front.
+
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <string.h>
+
+#include "framepool.h"
+
+#define PKT_DATA 0x01
+#define PKT_END 0x03
+#define PKT_SEEK 0x04
+#define PKT_BLOCKHASH 0x05
+#define PKT_COPY 0x06
+
+#define PKT_END_SIZE 17
+#define PKT_SEEK_SIZE 9
+#define PKT_BLOCKHASH_SIZE 17
+#define PKT_COPY_SIZE 13
+
+// Largest COPY, which bounds the output one I-frame can queue at the receiver
+#define PKT_COPY_MAX 65536
+
+static inline void putU64(unsigned char* p, unsigned long long v){
+    for (int i = 7; i >= 0; i--){
+        p[i] = v & 0xFF;
+        v >>= 8;
+    }
+}
+
+static inline void putU32(unsigned char* p, unsigned int v){
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline unsigned int getU32(const unsigned char* p){
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline unsigned long long getU64(const unsigned char* p){
+    unsigned long long v = 0;
+    for (int i = 0; i < 8; i++)
+        v = (v << 8) | p[i];
+    return v;
+}
+
+// Builders shared by every stream that goes out, so that all of them encode
+// the same way. Each returns the packet length.
+
+// DATA with as much of data as its I-frame holds; *used is how much it took
+static inline int packetData(unsigned char packet[], const unsigned char* data, int len, int* used){
+    packet[0] = PKT_DATA;
+    *used = frameSpan(packet, 1, data, len);
+    memcpy(packet + 1, data, *used);
+    return 1 + *used;
+}
+
+static inline int packetEnd(unsigned char packet[], long long total, unsigned long long hash){
+    packet[0] = PKT_END;
+    putU64(packet + 1, total);
+    putU64(packet + 9, hash);
+    return PKT_END_SIZE;
+}
+
+#endif
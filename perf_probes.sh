@@ -0,0 +1,28 @@
+#!/bin/sh
+# Per-frame send-to-acknowledgment latency from the USDT probes, with perf
+#
+# Records frame_acked while write_datalink sends a file, then prints the
+# latency percentiles in microseconds. write_datalink must be built with
+# <sys/sdt.h> (see probes.h); perf needs the rights to add uprobes.
+#
+# Usage: ./perf_probes.sh <SerialPort> <filename> [write_datalink arguments...]
+
+BIN=${BIN:-./write_datalink}
+DIR=$(mktemp -d)
+trap 'perf probe -q -d "sdt_datalink:*" 2>/dev/null; rm -rf "$DIR"' EXIT
+
+perf buildid-cache --add "$BIN" || exit 1
+perf probe -q -x "$BIN" -a sdt_datalink:frame_acked -a sdt_datalink:timeout || exit 1
+perf record -q -o "$DIR/perf.data" -e sdt_datalink:frame_acked -e sdt_datalink:timeout -- "$BIN" "$@" > /dev/null
+
+# perf numbers the probe's arguments from 1: arg2 is when the frame was
+# sent, arg3 when it was acknowledged
+perf script -i "$DIR/perf.data" -F event,trace |
+    awk '/frame_acked/ { for (i = 1; i <= NF; i++) { if ($i ~ /^arg2=/) s = substr($i, 6); if ($i ~ /^arg3=/) a = substr($i, 6) }
+                         print (a - s) / 1000 }
+         /timeout/ { timeouts++ }
+         END { if (timeouts) print timeouts " timeouts" > "/dev/stderr" }' |
+    sort -n | awk '{ v[NR] = $1 } END {
+        if (NR == 0) { print "no frames acknowledged"; exit }
+        printf "%d frames, send to ack in us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+               NR, v[int(NR * 0.5) + 1], v[int(NR * 0.9) + 1], v[int(NR * 0.99) + 1], v[NR] }'
@@ -0,0 +1,46 @@
+// Static tracepoints on the link's hot paths
+//
+// Built against <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel),
+// every probe is one nop in the code and a note in the ELF file that
+// bpftrace, perf and SystemTap attach to as datalink:<name>. Without the
+// header they compile to nothing. The arguments are values the code has at
+// hand already, so a probe nobody listens to costs no work either. Times are
+// metricsNow() nanoseconds, CLOCK_MONOTONIC, the clock of bpftrace's nsecs.
+//
+//   frame_sent(seq, length, sentAt)          I-frame queued for the port; seq
+//                                            counts from 0, N(S) is seq mod the modulus
+//   frame_acked(seq, sentAt, ackedAt)        I-frame released by an RR, RNR or N(R)
+//   reply_received(type, seq, at)            frame read by the sender during the
+//                                            transfer, type as in enum frameType
+//   timeout(base, retries)                   retransmission timer fired at the sender
+//   frame_parsed(type, seq, length, readAt)  any frame out of the parser, readAt
+//                                            being when its last bytes were read
+//   frame_checked(seq, verdict, length)      I-frame judged by the receiver, verdict
+//                                            as arqReceive() returns it
+//   payload_committed(bytes, offset)         file bytes queued into the sink
+//   sink_written(bytes, queuedAt, writtenAt) output handed to the kernel
+//
+// ack_latency.bt and receive_latency.bt show the distributions live,
+// perf_probes.sh records the same with perf.
+
+#ifndef PROBES_H
+#define PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LINK_PROBES 1
+#endif
+#endif
+
+#ifdef LINK_PROBES
+#define linkProbe2(name, a, b) DTRACE_PROBE2(datalink, name, a, b)
+#define linkProbe3(name, a, b, c) DTRACE_PROBE3(datalink, name, a, b, c)
+#define linkProbe4(name, a, b, c, d) DTRACE_PROBE4(datalink, name, a, b, c, d)
+#else
+#define linkProbe2(name, a, b) ((void)0)
+#define linkProbe3(name, a, b, c) ((void)0)
+#define linkProbe4(name, a, b, c, d) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+// Frame format shared by the sender and the receiver
+//
+//   FLAG | A | C | BCC1 | [ D1 ... Dn | BCC2 ] | FLAG
+//
+// Supervision frames stop after BCC1. Inside the frame 0x7E and 0x7D are sent
+// as 0x7D followed by the byte XOR 0x20.
+//
+// Sequence numbers are 3 bits. Bit 0 sits where the original 1-bit Ns and Nr
+// did (bit 6 of an I-frame, bit 7 of RR/REJ) and bits 1-2 in bits 4-5, so
+// with modulus 2 the control bytes are the stop-and-wait ones below.
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#define FLAG 0x7E
+#define ESCAPE 0x7D
+#define FLAG_ESCAPE 0x5E
+#define ESCAPE_ESCAPE 0x5D
+
+#define A_SET 0x03 // commands from the sender, replies from the receiver
+#define A_RES 0x01 // commands from the receiver, replies from the sender
+
+#define C_SET 0x03
+#define C_DISC 0x0B
+#define C_UA 0x07
+#define C_RR_NR0 0x05
+#define C_RR_NR1 0x85
+#define C_REJ_NR0 0x01
+#define C_REJ_NR1 0x81
+#define C_I_NS0 0x00
+#define C_I_NS1 0x40
+
+// Framing of the data field. SET may carry one option byte naming the
+// framing the sender wants, and a UA that echoes it agrees to it; the option
+// itself is always byte stuffed. A peer that ignores the option answers with
+// a plain UA and the link stays on byte stuffing.
+//
+// COBS frames keep the FLAG | A | C | BCC1 header and the closing FLAG, but
+// the data and BCC2 are sent as blocks: a code byte XOR FLAG giving the
+// block length, then up to 254 bytes as they are, with a FLAG implied after
+// every block shorter than 255 but the last. No byte is ever doubled, so the
+// overhead is 1 byte per 254 whatever the data.
+#define FRAMING_HDLC 0
+#define FRAMING_COBS 1
+#define COBS_BLOCK 255
+
+// The option byte is a set of bits: the framing, and whether the receiver
+// should send a file back over the same link (see duplex.h)
+#define OPTION_DUPLEX 0x02
+
+// Fast open: the sender's first window of I-frames follows the SET without
+// waiting for the UA. A receiver takes I-frames as soon as it has answered a
+// SET, and echoes this bit to say so; without the echo the sender sends
+// those frames again, which an ARQ receiver takes as duplicates at worst.
+#define OPTION_FASTOPEN 0x04
+
+// The SET names the sender's ARQ in a second option byte (see
+// arqConfigOption()) and the UA echoes the receiver's. Without this bit the
+// end runs the built-in stop-and-wait. A receiver whose ARQ differs answers
+// the SET with a DISC instead of a UA.
+#define OPTION_ARQ 0x08
+
+#define SEQ_MODULUS 8
+#define SEQ_HIGH(n) ((((n) >> 1) & 3) << 4)
+#define C_I(ns) ((((ns) & 1) << 6) | SEQ_HIGH(ns))
+#define C_RR(nr) (C_RR_NR0 | (((nr) & 1) << 7) | SEQ_HIGH(nr))
+#define C_REJ(nr) (C_REJ_NR0 | (((nr) & 1) << 7) | SEQ_HIGH(nr))
+#define C_SREJ(nr) (0x09 | (((nr) & 1) << 7) | SEQ_HIGH(nr)) // selective reject, Selective Repeat only
+#define C_RNR(nr) (0x0D | (((nr) & 1) << 7) | SEQ_HIGH(nr))  // receiver not ready, acknowledges before nr
+
+// Flow control. An RR may carry one data byte, the credit: how many frames
+// from N(R) on the receiver can take. An RR without it grants the whole
+// window, and RNR is a credit of 0 that pauses the sender until an RR.
+
+// When both ends send I-frames, each one carries the N(R) of its own end in
+// bits 1-3, flagged by bit 7, and stands for an RR. Bit 0 is 0 in every
+// I-frame and 1 in every other frame, so none of these clash.
+#define C_I_ACK(ns, nr) (C_I(ns) | 0x80 | (((nr) & 7) << 1))
+
+#endif
@@ -1,6 +1,10 @@
 // Read from serial port in non-canonical mode
 //
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
+//
+// Build: gcc -o read_datalink read_datalink.c framepool.c frameparser.c framesink.c framesource.c hash.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread
+
+#define _FILE_OFFSET_BITS 64
 
 #include <fcntl.h>
 #include <stdio.h>
@@ -11,6 +15,20 @@
 #include <termios.h>
 #include <unistd.h>
 
+#include "arq.h"
+#include "duplex.h"
+#include "framepool.h"
+#include "frameparser.h"
+#include "framesink.h"
+#include "hash.h"
+#include "ioengine.h"
+#include "metrics.h"
+#include "packet.h"
+#include "probes.h"
+#include "protocol.h"
+#include "realtime.h"
+#include "trace.h"
+
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B38400
@@ -19,71 +37,201 @@
 #define FALSE 0
 #define TRUE 1
 
-#define C_SET 0x03
-#define A_SET 0x03
-#define A_RES 0x01
-#define C_DISC 0x0B
-#define C_UA 0x07
-#define FLAG 0x7E
-#define C_RR_NR0 0x05
-#define C_RR_NR1 0x85
-#define C_REJ_NR0 0x01
-#define C_REJ_NR1 0x81
-
 #define BUF_SIZE 256
 
-#define frameflag 0x7E
-#define address1 0x03
-#define address2 0x01
+// Sequence numbers on the wire, as on the sender unless DATALINK_ARQ says otherwise
+#define WINDOW 1
+#define MODULUS 2
+#define REORDER_SLOTS (SEQ_MODULUS / 2) // the largest Selective Repeat window
+
+// The file sent back with --send runs its own timers, as on the sender
+#define RETRANSMIT_TIMEOUT_MS 5000
+#define MAX_RETRIES 2
+#define IDLE_WAIT_MS 1000
+
+// Flow control: RNR stops the sender before the output backlog fills the
+// sink's ring, and an RR lets it go again once the disk has written out half
+#define FLOW_RESUME_BACKLOG (SINK_BUFFER_SIZE / 2)
+#define FLOW_POLL_MS 20 // how often a stopped receiver looks at the backlog
 
 volatile int STOP = FALSE;
-int Ns = 0;
-int Nr = 1;
-
-void swap();
-int checkSupervision(unsigned char* buf, int length, u_int8_t ctrField);
-int checkData(unsigned char buf[],unsigned char message[], int* messageC);
-void clearBuffer(unsigned char buf[]);
-
-
-int readByByte(unsigned char buf[], int fd){
-    unsigned char x[1];
-    printf ("\n");
-    for(int i = 0; i<500; i++){
-        if(read(fd, x, 1)){
-            printf("x%d %d   ", i, x[0]);
-            buf[i] = x[0];
-        }
-        else return 0;
-    }
-    return 1;
-}
+struct arqReceiver arq;
+struct ioEngine io;
 
+// Good frames that arrived after a gap wait here until it is filled
+unsigned char reorder[REORDER_SLOTS][FRAME_SIZE];
+int reorderLength[REORDER_SLOTS];
 
-void swap(){
-    if (Ns) Ns = 0;
-    else Ns = 1;
+// With --send a file goes back to the sender while its own arrives, once the
+// sender asked for it in the SET
+int duplexMode = FALSE;
+struct duplexSend reverse;
 
-    if (Nr) Nr = 0;
-    else Nr = 1;
- }
+int deliverPacket(unsigned char packet[], int length);
+void sendReply(struct frame* reply);
+int stopped = FALSE;
 
 
+void sendReply(struct frame* reply){
+    ioWrite(&io, reply->data, reply->length);
+    traceRecord(TRACE_OUT, reply->data, reply->length);
+    metricAdd(framesSent, 1);
+    metricAdd(wireBytesOut, reply->length);
+}
 
-void trama(u_int8_t a,u_int8_t b,u_int8_t c,u_int8_t d,u_int8_t e,unsigned char buf[]){
-    buf[0] = a;
-    buf[1] = b;
-    buf[2] = c;
-    buf[3] = d;
-    buf[4] = e;
+// Output side of the transfer. Everything written is hashed per block and
+// compared with the sender's BLOCKHASH packets; blocks that differ are listed
+// in <output>.bad as "offset length" lines for write_datalink --ranges.
+// Output "-" streams to stdout, with diagnostics moved to stderr.
+const char* outputName;
+int streaming = FALSE;
+int verbose = FALSE; // DATALINK_VERBOSE=1: file data and per-frame progress on stdout too
+struct frameSink toWrite;
+struct blockHasher hasher;
+long long received = 0;
+long long offset = 0;
+int repair = FALSE;
+FILE* badList = NULL;
+int badBlocks = 0;
+
+// Old copy that COPY packets of a delta transfer point into
+int basis = -1;
+
+void markBad(long long blockIndex, long long length){
+    if (badList == NULL){
+        char name[4096];
+        snprintf(name, sizeof(name), "%s.bad", outputName);
+        badList = fopen(name, "w");
+        if (badList == NULL){
+            perror(name);
+            return;
+        }
+    }
+    fprintf(badList, "%lld %lld\n", blockIndex * HASH_BLOCK_SIZE, length);
+    badBlocks++;
 }
 
-void clearBuffer(unsigned char buf[]){
-    for (int i = 0; i < 500; i++){
-        buf[i] = 0;
+// Hashes the output file as it now is on disk, for the END check after a repair
+uint64_t outputHash(long long* size){
+    uint64_t hash = 0;
+    int file = open(outputName, O_RDONLY);
+    if (file < 0 || !hashFile(file, size, &hash))
+        *size = -1;
+    if (file >= 0)
+        close(file);
+    return hash;
+}
+
+// Frames the sink can still take from N(R) on, at most the window. A DATA
+// frame brings less than FRAME_SIZE bytes, but with a basis any frame may be
+// a COPY of up to PKT_COPY_MAX, so credit is counted in those. A stopped
+// sender stays stopped until the backlog is down to FLOW_RESUME_BACKLOG.
+int sinkCredit(int window){
+    long long backlog = sinkBacklog(&toWrite);
+    if (stopped && backlog > FLOW_RESUME_BACKLOG)
+        return 0;
+    long long frames = (SINK_BUFFER_SIZE - backlog) / (basis >= 0 ? PKT_COPY_MAX : FRAME_SIZE);
+    return frames < window ? frames : window;
+}
+
+// RR for nr with the credit when it is less than the window, or RNR when
+// there is none
+void buildReceiveReady(struct frame* reply, int nr, int credit, int window){
+    unsigned char c = credit;
+    if (credit == 0){
+        frameSupervision(reply, A_RES, C_RNR(nr));
+        metricAdd(notReady, 1);
+        if (!stopped)
+            printf("Output is behind, sender stopped\n");
+        stopped = TRUE;
+    }
+    else if (credit < window)
+        frameSupervisionData(reply, A_RES, C_RR(nr), &c, 1);
+    else
+        frameSupervision(reply, A_RES, C_RR(nr));
+}
+
+// Hands a good I-frame payload to the application. Returns FALSE if the
+// output cannot be written.
+int deliverPacket(unsigned char packet[], int length){
+    if (length > 0 && packet[0] == PKT_DATA){
+        if (verbose && !streaming)
+            fwrite(packet + 1, 1, length - 1, stdout);
+        if (!sinkWrite(&toWrite, packet + 1, length - 1))
+            return FALSE;
+        hasherUpdate(&hasher, packet + 1, length - 1);
+        metricAdd(payloadBytesIn, length - 1);
+        linkProbe2(payload_committed, length - 1, offset);
+        received += length - 1;
+        offset += length - 1;
+    }
+    else if (length == PKT_COPY_SIZE && packet[0] == PKT_COPY){
+        unsigned char buf[SINK_WRITE_SIZE];
+        long long from = getU64(packet + 1);
+        long long left = getU32(packet + 9);
+        if (basis < 0){
+            printf("COPY without a basis file\n");
+            return FALSE;
+        }
+        if (left > PKT_COPY_MAX){
+            printf("COPY of %lld bytes, more than %d\n", left, PKT_COPY_MAX);
+            return FALSE;
+        }
+        while (left > 0){
+            int n = left < (long long)sizeof(buf) ? left : (long long)sizeof(buf);
+            n = pread(basis, buf, n, from);
+            metricAdd(syscalls, 1);
+            if (n <= 0 || !sinkWrite(&toWrite, buf, n))
+                return FALSE;
+            hasherUpdate(&hasher, buf, n);
+            metricAdd(payloadBytesIn, n);
+            linkProbe2(payload_committed, n, offset);
+            from += n;
+            left -= n;
+            received += n;
+            offset += n;
+        }
+    }
+    else if (length == PKT_SEEK_SIZE && packet[0] == PKT_SEEK){
+        offset = getU64(packet + 1);
+        if (!sinkSeek(&toWrite, offset))
+            return FALSE;
+        hasherStartBlock(&hasher, offset / HASH_BLOCK_SIZE);
+    }
+    else if (length == PKT_BLOCKHASH_SIZE && packet[0] == PKT_BLOCKHASH){
+        long long blockIndex = getU64(packet + 1);
+        if (blockIndex != hasher.blockIndex)
+            markBad(blockIndex, HASH_BLOCK_SIZE);
+        else if (getU64(packet + 9) != xxh64Digest(&hasher.block)){
+            printf("Block %lld does not match\n", blockIndex);
+            markBad(blockIndex, hasher.blockFill);
+        }
+        hasherStartBlock(&hasher, blockIndex + 1);
     }
+    else if (length == PKT_END_SIZE && packet[0] == PKT_END){
+        long long total = getU64(packet + 1);
+        uint64_t hash = getU64(packet + 9);
+        long long size = received;
+        uint64_t ours = xxh64Digest(&hasher.whole);
+        if (repair){
+            if (!sinkFlush(&toWrite))
+                return FALSE;
+            ours = outputHash(&size);
+        }
+        if (total != size)
+            printf("End of stream, sender says %lld bytes but %lld arrived", total, size);
+        else if (hash != ours)
+            printf("End of stream, %lld bytes but the file hash does not match", size);
+        else
+            printf("End of stream, %lld bytes, file hash %016llx OK", size, (unsigned long long)ours);
+        if (badBlocks > 0)
+            printf("\n%d bad blocks listed in %s.bad", badBlocks, outputName);
+    }
+    return TRUE;
 }
 
+
+
 int main(int argc, char *argv[])
 {
     // Program usage: Uses either COM1 or COM2
@@ -92,14 +240,57 @@ int main(int argc, char *argv[])
     if (argc < 3)
     {
         printf("Incorrect program usage\n"
-               "Usage: %s <SerialPort> <filename>\n"
-               "Example: %s /dev/ttyS1 pinguim1.gif\n",
+               "Usage: %s <SerialPort> <filename | -> [--repair | --basis <oldfile>] [--send <file>]\n"
+               "Example: %s /dev/ttyS1 pinguim1.gif\n"
+               "         %s /dev/ttyS1 pinguim2.gif --basis pinguim1.gif\n"
+               "         %s /dev/ttyS1 pinguim1.gif --send reply.txt\n"
+               "         %s /dev/ttyS1 - | gunzip > pinguim.tar\n",
+               argv[0],
+               argv[0],
+               argv[0],
                argv[0],
                argv[0]);
         exit(1);
     }
-    
-    
+    // The stream gets stdout to itself before anything else is printed
+    streaming = strcmp(argv[2], "-") == 0;
+    if (streaming && !sinkClaimStdout()){
+        perror("stdout");
+        exit(1);
+    }
+    if (!sinkConfigFromEnv())
+        exit(1);
+    if (!realtimeStart())
+        exit(1);
+    struct arqConfig config = {
+        .window = WINDOW,
+        .modulus = MODULUS,
+        .timeout = RETRANSMIT_TIMEOUT_MS * 1000000LL,
+        .policy = ARQ_TIMEOUT_FIXED,
+        .maxRetries = MAX_RETRIES,
+        .mode = ARQ_GO_BACK_N,
+    };
+    if (!arqConfigFromEnv(&config))
+        exit(1);
+
+    const char* wantVerbose = getenv("DATALINK_VERBOSE");
+    if (wantVerbose != NULL && strcmp(wantVerbose, "1") == 0)
+        verbose = TRUE;
+    else if (wantVerbose != NULL && *wantVerbose != '\0' && strcmp(wantVerbose, "0") != 0){
+        printf("DATALINK_VERBOSE must be 0 or 1, not %s\n", wantVerbose);
+        exit(1);
+    }
+
+    // --send takes a file back to the sender, "-" is stdin
+    const char* sendName = NULL;
+    for (int i = 3; i + 1 < argc; i++)
+        if (strcmp(argv[i], "--send") == 0)
+            sendName = argv[i + 1];
+    if (sendName != NULL && !duplexSendOpen(&reverse, sendName, &config, A_RES)){
+        perror(sendName);
+        exit(1);
+    }
+
     // Open serial port device for reading and writing and not as controlling tty
     // because we don't want to get killed if linenoise sends CTRL-C.
     int fd = open(serialPortName, O_RDWR | O_NOCTTY);
@@ -109,11 +300,25 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    FILE *toWrite;
+    // --repair patches the listed ranges into an existing copy
+    outputName = streaming ? "stdout" : argv[2];
+    repair = argc > 3 && strcmp(argv[3], "--repair") == 0;
+    if (repair && streaming){
+        printf("A stream cannot be repaired in place, --repair needs a file\n");
+        exit(1);
+    }
+    hasherInit(&hasher);
 
-    toWrite = fopen(argv[2],"w");
+    // --basis rebuilds the file from an old copy and the sender's delta
+    if (argc > 4 && strcmp(argv[3], "--basis") == 0){
+        basis = open(argv[4], O_RDONLY);
+        if (basis < 0){
+            perror(argv[4]);
+            exit(1);
+        }
+    }
 
-     if(toWrite==NULL)
+     if(!sinkOpen(&toWrite, argv[2], !repair))
         {
             printf(" Error in opening file!");
             exit(1);
@@ -160,141 +365,252 @@ int main(int argc, char *argv[])
 
     printf("New termios structure set\n");
 
-    // Loop for input
-    unsigned char buf[500];
+    if (!framePoolInit()){
+        printf("error: cannot allocate frame pool\n");
+        exit(-1);
+    }
+    metricsInit("read_datalink");
+    arqReceiverInit(&arq, &config);
+    if (!traceStart())
+        exit(-1);
+
+    // Loop for input. Frames are parsed into message, replies go out from reply
+    unsigned char message[FRAME_SIZE];
+    struct frameReader reader;
+    struct frameInfo info;
+    readerInit(&reader, fd, message, sizeof(message));
+    if (!ioEngineInit(&io, fd))
+        exit(-1);
+    reader.io = &io;
+    // Sending as well, the loop cannot block on the port
+    if (sendName != NULL)
+        ioSetBlocking(&io, FALSE);
+    printf("Serial I/O through %s\n", ioEngineName(&io));
+    printf("ARQ %s, window %d\n", arqModeName(&config), config.window);
+    struct frame* reply = frameAcquire();
     
     //If the received trama is correct it moves forward, else it reads the trama sent again, if it reads it for more than 3 times it gets a error and exits
     int count = 0;
     int disconnecting = 0;
     int state = 0;
-    int ignore = 0;
-    unsigned char message[493];
-    int messageC = 0;
-    unsigned char trash[493];
+    unsigned char framing = FRAMING_HDLC;
+    unsigned char fastOpen = 0;
     while (count < 3){
-        if (readByByte(buf,fd)){
-                
-                
-            if (checkData(buf,trash, &messageC) && state == 1){
-                state++;
-                count = 0;
+        long headerErrors = reader.parser.stats.headerErrors;
+        metricsPoll();
+        // Duplicates and frames past a gap are passed over as they arrive
+        reader.parser.skip = arqReceiverUnwanted(&arq);
+        // A stopped sender is let go as soon as the disk has caught up
+        if (stopped && sinkCredit(config.window) > 0){
+            stopped = FALSE;
+            printf("Output caught up, sender resumed\n");
+            buildReceiveReady(reply, arq.expected % config.modulus, sinkCredit(config.window), config.window);
+            sendReply(reply);
+        }
+        // While stopped the port is polled, so that the backlog is looked at
+        if ((sendName == NULL && !stopped) != io.blocking)
+            ioSetBlocking(&io, sendName == NULL && !stopped);
+        if (sendName == NULL && !stopped){
+            if (!readFrame(&reader, &info))
+                continue;
+        }
+        else {
+            // Our own frames go first, each acknowledging what has arrived
+            if (duplexMode){
+                duplexSendFill(&reverse);
+                if (duplexSendPump(&reverse, &io, arq.expected % config.modulus) < 0){
+                    perror("write");
+                    exit(-1);
+                }
             }
-            else if (state == 1){
-                state--;
+            long long left = stopped ? FLOW_POLL_MS : IDLE_WAIT_MS;
+            if (reverse.arq.deadline > 0 && (reverse.arq.deadline - metricsNow()) / 1000000 < left)
+                left = (reverse.arq.deadline - metricsNow()) / 1000000;
+            if (!readFrameTimeout(&reader, &info, left > 0 ? left : 0)){
+                if (duplexMode && arqSenderTick(&reverse.arq, metricsNow())){
+                    printf("\nBAD READ\n");
+                    metricAdd(timeouts, 1);
+                }
+                if (reverse.arq.failed){
+                    printf("Timed out!!!");
+                    exit(-1);
+                }
+                continue;
             }
-            if (state == 2 && checkSupervision(buf, 500, C_DISC)){
-                trama(FLAG,A_RES,C_DISC, A_RES^C_DISC, FLAG,buf);
-                write(fd, buf, 500);
-                clearBuffer(buf);
-                disconnecting = 1;
-                break;
+        }
+        long long start = metricsNow();
+        if (reader.parser.stats.headerErrors != headerErrors){
+            // Wrong header - No action, wait for timeout and resend
+            printf("Wrong header\n");
+            count++;
+        }
+
+        if (info.type == FRAME_SET && state == 0 && !info.bccOk)
+            printf("SET options damaged, waiting for it again\n");
+        else if (info.type == FRAME_SET){
+            // Also answers a repeated SET whose first UA got lost, with the
+            // framing already agreed: under COBS its option no longer parses
+            unsigned char options = state == 0 && info.bccOk && info.length >= 1 ? info.payload[0] : 0;
+            unsigned char arqOption = arqConfigOption(&config);
+            unsigned char theirArq = (options & OPTION_ARQ) && info.length >= 2 ? info.payload[1] : 0;
+            // A sender on another ARQ would read our replies wrong and we its
+            // frames, so it is turned away before a byte of the file is taken
+            if (state == 0 && theirArq != arqOption){
+                char ourName[16], theirName[16];
+                arqOptionFormat(ourName, sizeof(ourName), arqOption);
+                arqOptionFormat(theirName, sizeof(theirName), theirArq);
+                printf("Sender runs DATALINK_ARQ=%s, this end %s: refusing the SET\n", theirName, ourName);
+                frameSupervision(reply, A_RES, C_DISC);
+                sendReply(reply);
+                ioEngineClose(&io);
+                exit(-1);
             }
-            else if (state == 2){
-                //printf("bytes\n");
-                clearBuffer(message);
-                printf("here - %d\n", checkData(buf,message,&messageC));
-                switch (checkData(buf,trash,&messageC))
-                {
-                case 0: // Repeated message, doesn't print
-                    printf("Repeated message");
-                    clearBuffer(buf);
+            if (options & FRAMING_COBS)
+                framing = FRAMING_COBS;
+            if (state == 0 && sendName != NULL){
+                duplexMode = (options & OPTION_DUPLEX) != 0;
+                printf(duplexMode ? "Sending %s back\n" : "Sender takes nothing back, not sending %s\n", sendName);
+            }
+            // I-frames are taken from here on, including any that came
+            // right behind this SET
+            if (state == 0 && (options & OPTION_FASTOPEN)){
+                fastOpen = OPTION_FASTOPEN;
+                printf("Fast open, taking data with the SET\n");
+            }
+            unsigned char agreed = framing | (duplexMode ? OPTION_DUPLEX : 0) | fastOpen |
+                                   (arqOption != 0 ? OPTION_ARQ : 0);
+            unsigned char bytes[2] = { agreed, arqOption };
+            if (agreed == 0)
+                frameSupervision(reply, A_RES, C_UA);
+            else
+                frameOptions(reply, A_RES, C_UA, bytes, (agreed & OPTION_ARQ) ? 2 : 1);
+            printf("sending\n");
+            sendReply(reply);
+            if (framing != reader.parser.framing){
+                frameSetFraming(framing);
+                reader.parser.framing = framing;
+                printf("Framing: cobs\n");
+            }
+            state = 1;
+            printf("good\n");
+        }
+        else if (info.type == FRAME_DISC && state == 1){
+            frameSupervision(reply, A_RES, C_DISC);
+            sendReply(reply);
+            disconnecting = 1;
+            break;
+        }
+        else if (duplexMode && state == 1 && (info.type == FRAME_RR || info.type == FRAME_REJ || info.type == FRAME_SREJ)){
+            if (verbose)
+                printf("\nGOOD READ %s%d\n", frameTypeName(info.type), info.seq);
+            duplexSendReply(&reverse, info.type, info.seq, metricsNow());
+        }
+        else if (info.type == FRAME_I && state == 1){
+            int replyType, replySeq;
+            // Its N(R) is an RR for the frames we send back
+            if (duplexMode && info.nr >= 0)
+                duplexSendReply(&reverse, FRAME_RR, info.nr, start);
+            // No room for it: dropped, and the sender stopped or reminded
+            // that it is. It comes again once we say RR.
+            int credit = sinkCredit(config.window);
+            if (credit == 0){
+                printf("Output is behind, message dropped\n");
+                buildReceiveReady(reply, arq.expected % config.modulus, 0, config.window);
+                sendReply(reply);
+                continue;
+            }
+            int verdict = arqReceive(&arq, info.seq, info.bccOk, &replyType, &replySeq);
+            linkProbe3(frame_checked, info.seq, verdict, info.length);
+            switch (verdict){
+                case ARQ_DELIVER:
+                    // Correct message, prints
                     count = 0;
-                    if (Nr)
-                        trama(FLAG,A_RES,C_RR_NR1,A_RES ^ C_RR_NR1, FLAG, buf);
-                    else
-                        trama(FLAG,A_RES,C_RR_NR0,A_RES ^ C_RR_NR0, FLAG, buf);
+                    if (!deliverPacket(message, info.length)){
+                        perror(outputName);
+                        exit(-1);
+                    }
+                    // and the frames held behind it, in order
+                    for (long long held = arq.expected - arq.released; held < arq.expected; held++){
+                        int slot = arqReceiverSlot(&arq, held);
+                        if (!deliverPacket(reorder[slot], reorderLength[slot])){
+                            perror(outputName);
+                            exit(-1);
+                        }
+                    }
+                    if (verbose)
+                        printf("\n");
                     break;
-
-                case 1: // Correct message, prints
+                case ARQ_BUFFER:
+                    printf("Out of order message, held");
+                    memcpy(reorder[arqReceiverSlot(&arq, arq.frame)], message, info.length);
+                    reorderLength[arqReceiverSlot(&arq, arq.frame)] = info.length;
+                    metricAdd(reordered, 1);
                     count = 0;
-                    for(int i=0; i < (messageC); i++){
-                        printf("%c",message[i]);
-                        fputc(message[i], toWrite);
-                    }
-                    printf("\n");
-                    clearBuffer(buf);
-                    if (Nr)
-                        trama(FLAG,A_RES,C_RR_NR1,A_RES ^ C_RR_NR1, FLAG, buf);
-                    else
-                        trama(FLAG,A_RES,C_RR_NR0,A_RES ^ C_RR_NR0, FLAG, buf);
-                    swap();
                     break;
-
-                case 2: // Rejected message
+                case ARQ_DUPLICATE:
+                    // Repeated message, doesn't print. Ask again for the one we expect
+                    printf("Repeated message");
+                    metricAdd(duplicates, 1);
+                    count = 0;
+                    break;
+                case ARQ_REJECT:
                     printf("rejected message\n");
-                    clearBuffer(buf);
+                    metricAdd(framesRejected, 1);
                     count++;
-                    if (Nr)
-                        trama(FLAG,A_RES,C_REJ_NR1,A_RES ^ C_REJ_NR1, FLAG, buf);
-                    else
-                        trama(FLAG,A_RES,C_REJ_NR0,A_RES ^ C_REJ_NR0, FLAG, buf);
                     break;
-
-                case 3: // Wrong header - No action, wait for timeout and resend
-                    clearBuffer(buf);
-                    count++;
-                    printf("Wrong header\n");
+                default:
+                    printf("Out of order message\n");
                     break;
-                }
-                //for(int i=0; i < 20; i++)
-                //    printf("%d -", buf[i]);
-                //write(fd, buf, 500);
             }
-            //for(int i=0; i < 5; i++)
-            //    printf("%d -", buf[i]);
-            //printf("\n");
-            
-            printf("\n Ns = %d Nr = %d \n", Ns, Nr);
-
-            if (checkSupervision(buf, 500, C_SET) && state == 0){
-                trama(FLAG,A_RES,C_UA,A_RES ^ C_UA,FLAG,buf);
-                printf("sending\n");
-
-                for(int j = 0; j<500; j++)
-                    printf("%d ", buf[j]);
-                //lseek(fd, 0, SEEK_SET);
-                write(fd, buf, 500);
-                printf("reading\n");
-                state++;
-                printf("good\n");
-                count++;
+            // The RR rides on the I-frame that goes out next, if one can
+            // and no credit needs to go with it
+            credit = sinkCredit(config.window);
+            if (replyType == FRAME_RR && credit == config.window && duplexMode && duplexSendCanSend(&reverse)){
+                replyType = FRAME_NONE;
+                metricAdd(piggybacked, 1);
             }
-            else if (!ignore){
-                write(fd,buf,500);
+            if (replyType == FRAME_RR)
+                buildReceiveReady(reply, replySeq, credit, config.window);
+            else if (replyType == FRAME_REJ)
+                frameSupervision(reply, A_RES, C_REJ(replySeq));
+            else if (replyType == FRAME_SREJ)
+                frameSupervision(reply, A_RES, C_SREJ(replySeq));
+            if (replyType != FRAME_NONE){
+                sendReply(reply);
+                histogramRecord(&metrics.turnaround, metricsNow() - reader.readAt);
             }
-            else{
-                write(fd,buf,500);
-            }
-            
-            //printf("count %i   state %i  \n",count, state);
-
-            /* for(int i=0; i < 500; i++)
-                printf("%d -", buf[i]);
-            printf("\n"); */
-            clearBuffer(buf);
-            
+            histogramRecord(&metrics.processing, metricsNow() - start);
+            if (verbose)
+                printf("\n Expecting %lld \n", arq.expected % config.modulus);
         }
+        else
+            printf("Ignoring %s frame\n", frameTypeName(info.type));
     }
     if (count > 2){
         perror("Something went wrong...connection lost");
         exit(-1);
     }
     if(disconnecting == 1){
-        clearBuffer(buf);
-        int flags = fcntl(fd, F_GETFL, 0);
-        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-        sleep(1);
-        if ((readByByte(buf,fd)))
-            if(checkSupervision(buf, 500, C_UA))
-                printf("UA RECEIVED DISCONNECTING");
-            else
-                printf("UA NOT RECEIVED, DISCONNECTING");
-            // if UA end
-        
+        ioSetBlocking(&io, FALSE);
+        if (readFrameTimeout(&reader, &info, 1000) && info.type == FRAME_UA)
+            printf("UA RECEIVED DISCONNECTING");
+        else
+            printf("UA NOT RECEIVED, DISCONNECTING");
     }
 
-    clearBuffer(buf);
+    if (duplexMode){
+        if (duplexSendDone(&reverse))
+            printf("\n%lld bytes sent back from %s", reverse.src.total, sendName);
+        else
+            printf("\n%lld bytes of %s sent back, not all of them acknowledged", reverse.src.total, sendName);
+    }
+    if (sendName != NULL)
+        duplexSendClose(&reverse);
+    ioEngineClose(&io);
+    frameRelease(reply);
     printf("\n");
+    framePoolReport("receiver");
+    metricsDump(stderr);
 
     // Restore the old port settings
     if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
@@ -302,191 +618,15 @@ int main(int argc, char *argv[])
         perror("tcsetattr");
         exit(-1);
     }
-    fclose(toWrite);
+    if (!sinkClose(&toWrite))
+        perror(outputName);
+    if (badList != NULL)
+        fclose(badList);
+    if (basis >= 0)
+        close(basis);
 
     close(fd);
 
     return 0;
 }
 
-
-int checkSupervision(unsigned char* buf, int length, u_int8_t ctrField){
-    int currentChar = 0;
-    int state = 0; // 0 = START, 1 = FLAG, 2 = ADDRESS, 3 = CONTROL, 4 = BCC, 5 = STOPFLAG
-    while(currentChar<length){
-        //printf("%d",buf[currentChar]);
-        switch(state){
-            case 0:
-                if(buf[currentChar] == FLAG)
-                    state = 1;
-                
-                currentChar++;
-                break;
-            
-            case 1:
-                if(buf[currentChar] == A_SET)
-                    state = 2;
-                else if(buf[currentChar] != FLAG)
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 2:
-                if(buf[currentChar] == ctrField)
-                    state = 3; 
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 3:
-                if(buf[currentChar] == buf[currentChar-1]^buf[currentChar-2])
-                    state = 4;
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-            
-            case 4:
-                if(buf[currentChar] == FLAG)
-                    return TRUE;
-                else 
-                    state = 0;
-                    
-                break;
-        }
-    }
-    return FALSE;
-}
-
-int checkData(unsigned char buf[], unsigned char message[], int* messageC){
-    int currentChar = 0;
-    int state = 0; // 0 = START, 1 = FLAG, 2 = ADDRESS, 3 = CONTROL, 4 = BCC, 5 = STOPFLAG
-    u_int8_t ctrField;
-    u_int8_t oppositeCtrField;
-    u_int8_t bcc = 0x00;
-    if (Ns == 1){
-        ctrField = 0x40;
-        oppositeCtrField = 0x00;
-    }
-    else{
-        ctrField = 0x00;
-        oppositeCtrField = 0x40;
-    }
-    int count = 0;
-    *messageC = 0;
-    int maxState = 0; //Checks for maximum state, decides to ignore the frame if maxState is from 0 to 3
-    while(currentChar<500){
-        //printf("%i --  %d",currentChar, buf[currentChar]);
-        switch(state){
-            case 0:
-                //printf("1\n");
-                if(buf[currentChar] == FLAG)
-                    state = 1;
-                currentChar++;
-                break;
-            
-            case 1:
-                //printf("2\n");
-                if (maxState < state)
-                    maxState = state;
-                if(buf[currentChar] == A_SET)
-                    state = 2;
-                else if(buf[currentChar] != FLAG)
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 2:
-                //printf("3\n");
-                if (maxState < state)
-                    maxState = state;
-                if(buf[currentChar] == ctrField)
-                    state = 3;
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 3:
-                //printf("4\n");
-                if (maxState < state)
-                    maxState = state;
-                if(buf[currentChar] == buf[currentChar-1]^buf[currentChar-2]){
-                    state = 4;
-                }
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-
-            case 4: // Reading data
-                //printf("5\n");
-                if (maxState < state)
-                    maxState = state;
-                if (buf[currentChar] == FLAG){
-                    //printf("FLAG");
-                    if (count > 1){
-                        bcc = bcc ^ message[(*messageC) - 2];
-                    }
-                    else if (count == 1){
-                        for (int i = (*messageC) - 1; i < 494; i ++){
-                            message[i] = 0;
-                        }
-                        return 1;
-                    }
-                    else
-                        return 2;
-
-                    if (buf[currentChar - 1] == bcc)
-                        (*messageC) = (*messageC) - 1;
-                        return 1;
-                    return 2; 
-                }
-                if (buf[currentChar] == 0x7d){
-                    if (buf[currentChar + 1] == 0x5e){
-                        message[(*messageC)] = 0x7e;
-                        currentChar++;
-                    }
-                    else if (buf[currentChar + 1] == 0x5d){
-                        message[(*messageC)] = 0x7d;
-                        currentChar++;
-                    }
-                    else{
-                        message[(*messageC)] = 0x7d;
-                    }
-                }
-                else{
-                    message[(*messageC)] = buf[currentChar];
-                }
-                if (count < 2)
-                    count++;
-                else
-                    bcc = bcc ^ message[(*messageC) - 2];
-                (*messageC) = (*messageC) + 1;
-                currentChar++;
-                break;
-        }
-    }
-    if (maxState < 4){
-        return 3;
-    }
-    if (state == 4)
-        return 2;
-    printf("\nEND\n");
-    return 0;
-}
@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "framepool.h"
+#include "metrics.h"
+#include "realtime.h"
+
+#define DEFAULT_PRIORITY 50
+#define PREFAULT_STACK (256 * 1024) // well beyond the deepest the link loops go
+#define PREFAULT_THREAD_STACK (64 * 1024) // the writer and the workers go far less deep
+
+static char mode[64];
+static int active = 0;
+static cpu_set_t helperCpus; // where threads started after realtimeStart() run
+
+// Touches the stack the link loops will grow into, so that no page fault
+// lands between a frame arriving and its reply
+static void prefaultStack(){
+    volatile unsigned char stack[PREFAULT_STACK];
+    memset((unsigned char*)stack, 0, sizeof(stack));
+}
+
+// Returns 0 only when DATALINK_RT cannot be parsed
+int realtimeStart(){
+    const char* want = getenv("DATALINK_RT");
+    if (want == NULL || *want == '\0')
+        return 1;
+    char* end;
+    long cpu = strtol(want, &end, 10);
+    long priority = DEFAULT_PRIORITY;
+    if (end != want && *end == ':')
+        priority = strtol(end + 1, &end, 10);
+    if (end == want || *end != '\0' || cpu < 0 || cpu >= CPU_SETSIZE ||
+        priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO)){
+        printf("DATALINK_RT must be <cpu>[:<priority>], not %s\n", want);
+        return 0;
+    }
+
+    int used = 0;
+    mode[0] = '\0';
+    if (!framePoolInit())
+        return 0;
+    active = 1;
+    if (sched_getaffinity(0, sizeof(helperCpus), &helperCpus) != 0)
+        CPU_ZERO(&helperCpus);
+    if (CPU_COUNT(&helperCpus) > 1)
+        CPU_CLR(cpu, &helperCpus);
+    prefaultStack();
+    if (mlockall(MCL_CURRENT) == 0)
+        used += snprintf(mode + used, sizeof(mode) - used, "locked ");
+    else
+        perror("mlockall");
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) == 0)
+        used += snprintf(mode + used, sizeof(mode) - used, "cpu %ld ", cpu);
+    else
+        perror("sched_setaffinity");
+
+    struct sched_param param = { .sched_priority = priority };
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == 0)
+        used += snprintf(mode + used, sizeof(mode) - used, "fifo %ld ", priority);
+    else
+        perror("sched_setscheduler");
+
+    if (used > 0)
+        mode[used - 1] = '\0';
+    else
+        snprintf(mode, sizeof(mode), "refused");
+    metricsMode(mode);
+    printf("Real-time mode: %s\n", mode);
+    return 1;
+}
+
+// First call of every helper thread: undoes what it inherited from the link
+// loop and locks the stack it will use, as realtimeStart() did for the loop's
+void realtimeThread(){
+    if (!active)
+        return;
+    if (CPU_COUNT(&helperCpus) > 0 && sched_setaffinity(0, sizeof(helperCpus), &helperCpus) != 0)
+        perror("sched_setaffinity");
+    struct sched_param param = { .sched_priority = 0 };
+    if (sched_setscheduler(0, SCHED_OTHER, &param) != 0)
+        perror("sched_setscheduler");
+    volatile unsigned char stack[PREFAULT_THREAD_STACK];
+    memset((unsigned char*)stack, 0, sizeof(stack));
+    if (mlock((unsigned char*)stack, sizeof(stack)) != 0)
+        perror("mlock");
+}
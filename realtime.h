@@ -0,0 +1,26 @@
+// Opt-in low-jitter mode for both endpoints
+//
+// Set DATALINK_RT=<cpu>[:<priority>] and the program locks its memory,
+// faults in the frame pool and the stack, pins itself to cpu and asks for
+// SCHED_FIFO at priority (50 by default). Each step that the system refuses
+// (usually EPERM without CAP_SYS_NICE or a large enough RLIMIT_MEMLOCK) is
+// reported and skipped, and the metrics JSON names what was actually applied.
+//
+// Call it before mapping any input file: only the memory that exists at that
+// point is locked, so a multi-gigabyte --delta or --spool mapping is never
+// pinned into RAM.
+//
+// Threads created afterwards (the sink writer, the encoder workers) would
+// inherit the link loop's single CPU and its SCHED_FIFO, leaving the
+// workers no parallelism and the writer competing with the loop, and their
+// stacks would miss the lock. Each one calls realtimeThread() first: it
+// moves to the CPUs the program had before, less the link loop's, back
+// under the normal scheduler, and locks the top of its own stack.
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+int realtimeStart();
+void realtimeThread();
+
+#endif
@@ -0,0 +1,356 @@
+// Discrete-event simulator of the link under a virtual clock
+//
+// Usage: simulate                       sweeps a built-in grid, CSV on stdout
+//        simulate <baud> <prop_ms> <ber> <payload> <window> <timeout_ms> [fixed | backoff] [gbn | sr] [frames]
+//
+// The ARQ decisions come from arq.c, the same state machine the programs
+// run on the serial port, so only the channel is modelled: each direction
+// sends one frame at a time at baud with 10 bits per byte, frames arrive
+// after the propagation delay, and every bit is flipped independently with
+// probability ber. A hit in the header drops the frame like a BCC1 error; a
+// hit in the data is a BCC2 error and draws a REJ, or an SREJ under
+// Selective Repeat. Supervision frames that are hit are lost.
+//
+// S is the share of the run the sender spent on I-frames that got through
+// (frames * Tframe / elapsed). a = Tprop / Tframe. S_theory is the textbook
+// figure for the same window: (1-P)/(1+2a) for stop-and-wait, and for
+// Go-Back-N (1-P)/(1+2aP) once W >= 1+2a, else W(1-P)/((1+2a)(1-P+WP)),
+// with P the chance an I-frame or its reply is hit. Selective Repeat resends
+// only what was lost, so its figure is 1-P once W >= 1+2a, else
+// W(1-P)/(1+2a). Large Go-Back-N windows fall short of the textbook under
+// errors because, as on the real port, frames are handed to the transmitter
+// a whole window ahead of the wire, so a go-back costs W frames rather
+// than 2a.
+//
+// Build: gcc -O2 -o simulate simulate.c arq.c -lm
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arq.h"
+#include "frameparser.h"
+
+#define SIM_FRAMES 1000
+#define SIM_MAX_EVENTS 4096
+#define SIM_MAX_RETRIES 16
+#define HEADER_BITS 40       // FLAG A C BCC1
+#define SUPERVISION_BYTES 5
+
+enum { EV_FRAME, EV_REPLY, EV_TIMER };
+
+struct event {
+    long long time;
+    int type;
+    int seq;
+    int headerOk; // EV_FRAME
+    int dataOk;   // EV_FRAME
+    int reply;    // EV_REPLY: FRAME_RR, FRAME_REJ or FRAME_SREJ
+};
+
+struct simConfig {
+    double baud;
+    double propagation; // s
+    double ber;
+    int payload;        // file bytes per I-frame
+    int window;
+    int policy;
+    int mode;           // ARQ_GO_BACK_N or ARQ_SELECTIVE
+    double timeout;     // s
+    int frames;
+};
+
+struct simResult {
+    double elapsed;     // s until the last frame was delivered
+    double a;
+    double S;
+    double theory;
+    int failed;
+    struct arqStats stats;
+};
+
+// Binary min-heap on time; insertion order breaks ties so runs are repeatable
+struct event heap[SIM_MAX_EVENTS];
+long long order[SIM_MAX_EVENTS];
+int heapSize;
+long long inserted;
+
+int before(int i, int j){
+    return heap[i].time < heap[j].time || (heap[i].time == heap[j].time && order[i] < order[j]);
+}
+
+void swapEvents(int i, int j){
+    struct event e = heap[i];
+    long long o = order[i];
+    heap[i] = heap[j];
+    order[i] = order[j];
+    heap[j] = e;
+    order[j] = o;
+}
+
+int push(const struct event* e){
+    if (heapSize == SIM_MAX_EVENTS)
+        return 0;
+    int i = heapSize++;
+    heap[i] = *e;
+    order[i] = inserted++;
+    while (i > 0 && before(i, (i - 1) / 2)){
+        swapEvents(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    return 1;
+}
+
+struct event pop(){
+    struct event top = heap[0];
+    heapSize--;
+    heap[0] = heap[heapSize];
+    order[0] = order[heapSize];
+    int i = 0;
+    while (1){
+        int smallest = i;
+        if (2 * i + 1 < heapSize && before(2 * i + 1, smallest))
+            smallest = 2 * i + 1;
+        if (2 * i + 2 < heapSize && before(2 * i + 2, smallest))
+            smallest = 2 * i + 2;
+        if (smallest == i)
+            break;
+        swapEvents(i, smallest);
+        i = smallest;
+    }
+    return top;
+}
+
+unsigned long long rng;
+
+double uniform(){
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (rng >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Chance that at least one of bits is flipped
+double hitProbability(double ber, double bits){
+    return ber > 0 ? -expm1(bits * log1p(-ber)) : 0.0;
+}
+
+// Stuffing adds about 2 bytes in 256 to random data
+int frameBytes(int payload){
+    return 4 + 1 + payload + payload / 128 + 1 + 1;
+}
+
+long long toNs(double seconds){
+    return llround(seconds * 1e9);
+}
+
+struct simResult simulate(const struct simConfig* c, unsigned long long seed){
+    struct simResult result;
+    struct arqSender sender;
+    struct arqReceiver receiver;
+    struct arqConfig config = {
+        .window = c->window,
+        .modulus = c->mode == ARQ_SELECTIVE ? 2 * c->window : c->window > 1 ? 8 : 2,
+        .timeout = toNs(c->timeout),
+        .maxTimeout = toNs(c->timeout) * 64,
+        .policy = c->policy,
+        .maxRetries = SIM_MAX_RETRIES,
+        .mode = c->mode,
+    };
+    double frameBits = frameBytes(c->payload) * 10.0;
+    double supervisionBits = SUPERVISION_BYTES * 10.0;
+    long long tFrame = toNs(frameBits / c->baud);
+    long long tSupervision = toNs(supervisionBits / c->baud);
+    long long tProp = toNs(c->propagation);
+    double headerHit = hitProbability(c->ber, HEADER_BITS);
+    double dataHit = hitProbability(c->ber, frameBits - HEADER_BITS);
+    double replyHit = hitProbability(c->ber, supervisionBits);
+
+    long long now = 0, senderFree = 0, receiverFree = 0, timerAt = 0;
+    long long delivered = 0, seq;
+    struct event e;
+
+    memset(&result, 0, sizeof(result));
+    rng = seed | 1;
+    heapSize = 0;
+    inserted = 0;
+    arqSenderInit(&sender, &config);
+    arqReceiverInit(&receiver, &config);
+
+    while (delivered < c->frames && !sender.failed){
+        // Sender side: fill the window, keep one timer event per deadline
+        while ((seq = arqSenderPick(&sender)) >= 0 && seq < c->frames){
+            long long start = now > senderFree ? now : senderFree;
+            senderFree = start + tFrame;
+            e.type = EV_FRAME;
+            e.time = senderFree + tProp;
+            e.seq = seq % config.modulus;
+            e.headerOk = uniform() >= headerHit;
+            e.dataOk = uniform() >= dataHit;
+            if (!push(&e))
+                break;
+            arqSenderSent(&sender, seq);
+        }
+        arqSenderDeparted(&sender, now);
+        if (sender.deadline != 0 && sender.deadline != timerAt){
+            e.type = EV_TIMER;
+            e.time = sender.deadline;
+            push(&e);
+            timerAt = sender.deadline;
+        }
+        if (heapSize == 0)
+            break;
+
+        e = pop();
+        now = e.time;
+        if (e.type == EV_TIMER)
+            arqSenderTick(&sender, now);
+        else if (e.type == EV_REPLY){
+            if (e.reply == FRAME_RR)
+                arqSenderAck(&sender, e.seq, now);
+            else if (e.reply == FRAME_SREJ)
+                arqSenderSelectiveReject(&sender, e.seq, now);
+            else
+                arqSenderReject(&sender, e.seq, now);
+        }
+        else if (e.headerOk){
+            int reply, replySeq;
+            if (arqReceive(&receiver, e.seq, e.dataOk, &reply, &replySeq) == ARQ_DELIVER)
+                delivered += 1 + receiver.released;
+            if (reply != FRAME_NONE && uniform() >= replyHit){
+                long long start = now > receiverFree ? now : receiverFree;
+                receiverFree = start + tSupervision;
+                e.type = EV_REPLY;
+                e.time = receiverFree + tProp;
+                e.reply = reply;
+                e.seq = replySeq;
+                push(&e);
+            }
+        }
+    }
+
+    double P = 1.0 - (1.0 - headerHit) * (1.0 - dataHit) * (1.0 - replyHit);
+    double a = (double)tProp / tFrame;
+    double W = c->window;
+    result.elapsed = now / 1e9;
+    result.a = a;
+    result.S = now > 0 ? (double)delivered * tFrame / now : 0.0;
+    if (c->mode == ARQ_SELECTIVE)
+        result.theory = (W >= 1 + 2 * a ? 1 : W / (1 + 2 * a)) * (1 - P);
+    else if (W == 1)
+        result.theory = (1 - P) / (1 + 2 * a);
+    else if (W >= 1 + 2 * a)
+        result.theory = (1 - P) / (1 + 2 * a * P);
+    else
+        result.theory = W * (1 - P) / ((1 + 2 * a) * (1 - P + W * P));
+    result.failed = delivered < c->frames;
+    result.stats = sender.stats;
+    return result;
+}
+
+void printHeader(){
+    printf("baud,prop_ms,ber,payload,window,arq,policy,timeout_ms,a,S,S_theory,"
+           "elapsed_s,sent,retransmitted,rejects,timeouts,failed\n");
+}
+
+void printResult(const struct simConfig* c, const struct simResult* r){
+    printf("%.0f,%g,%g,%d,%d,%s,%s,%g,%.4g,%.4f,%.4f,%.4g,%lld,%lld,%lld,%lld,%d\n",
+           c->baud, c->propagation * 1e3, c->ber, c->payload, c->window,
+           c->mode == ARQ_SELECTIVE ? "sr" : "gbn",
+           c->policy == ARQ_TIMEOUT_BACKOFF ? "backoff" : "fixed", c->timeout * 1e3,
+           r->a, r->S, r->theory, r->elapsed, r->stats.sent, r->stats.retransmitted,
+           r->stats.rejects, r->stats.timeouts, r->failed);
+}
+
+int main(int argc, char *argv[])
+{
+    struct simConfig c;
+    struct simResult r;
+
+    if (argc > 1 && argc < 7)
+    {
+        printf("Incorrect program usage\n"
+               "Usage: %s\n"
+               "       %s <baud> <prop_ms> <ber> <payload> <window> <timeout_ms> [fixed | backoff] [gbn | sr] [frames]\n"
+               "Example: %s 38400 0 1e-5 494 1 5000\n"
+               "         %s 115200 100 1e-5 494 4 500 sr\n",
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0]);
+        exit(1);
+    }
+
+    if (argc > 1)
+    {
+        c.baud = atof(argv[1]);
+        c.propagation = atof(argv[2]) / 1e3;
+        c.ber = atof(argv[3]);
+        c.payload = atoi(argv[4]);
+        c.window = atoi(argv[5]);
+        c.timeout = atof(argv[6]) / 1e3;
+        c.policy = ARQ_TIMEOUT_FIXED;
+        c.mode = ARQ_GO_BACK_N;
+        c.frames = SIM_FRAMES;
+        // The optional arguments are told apart by their value
+        for (int i = 7; i < argc; i++){
+            if (strcmp(argv[i], "backoff") == 0)
+                c.policy = ARQ_TIMEOUT_BACKOFF;
+            else if (strcmp(argv[i], "sr") == 0)
+                c.mode = ARQ_SELECTIVE;
+            else if (strcmp(argv[i], "fixed") != 0 && strcmp(argv[i], "gbn") != 0)
+                c.frames = atoi(argv[i]);
+        }
+        if (c.baud <= 0 || c.payload <= 0 || c.window < 1 || c.window > 7 || c.timeout <= 0)
+        {
+            printf("error: baud, payload and timeout must be positive, window 1 to 7\n");
+            exit(1);
+        }
+        printHeader();
+        r = simulate(&c, 1);
+        printResult(&c, &r);
+        return 0;
+    }
+
+    // Built-in sweep. Timeouts are set relative to the round trip so every
+    // a gets a sensible value: 1.5 and 4 times window frames + reply + 2 Tprop.
+    // The timer starts when a frame is written, so frames queued behind
+    // others in the window need that much longer.
+    double bauds[] = { 9600, 38400, 115200, 1000000 };
+    double propagations[] = { 0, 1e-4, 1e-3, 1e-2, 1e-1, 5e-1 };
+    double bers[] = { 0, 1e-6, 1e-5, 1e-4 };
+    int payloads[] = { 64, 256, 494, 1024, 4096 };
+    int windows[] = { 1, 3, 7 };
+    double factors[] = { 1.5, 4 };
+    int policies[] = { ARQ_TIMEOUT_FIXED, ARQ_TIMEOUT_BACKOFF };
+    int modes[] = { ARQ_GO_BACK_N, ARQ_SELECTIVE };
+    long long runs = 0;
+
+    printHeader();
+#define COUNT(a) (int)(sizeof(a) / sizeof(a[0]))
+    for (int i = 0; i < COUNT(bauds); i++)
+    for (int j = 0; j < COUNT(propagations); j++)
+    for (int k = 0; k < COUNT(bers); k++)
+    for (int l = 0; l < COUNT(payloads); l++)
+    for (int w = 0; w < COUNT(windows); w++)
+    for (int f = 0; f < COUNT(factors); f++)
+    for (int p = 0; p < COUNT(policies); p++)
+    for (int m = 0; m < COUNT(modes); m++)
+    {
+        c.baud = bauds[i];
+        c.propagation = propagations[j];
+        c.ber = bers[k];
+        c.payload = payloads[l];
+        c.window = windows[w];
+        c.policy = policies[p];
+        c.mode = modes[m];
+        c.frames = SIM_FRAMES;
+        double roundTrip = (c.window * frameBytes(c.payload) + SUPERVISION_BYTES) * 10.0 / c.baud + 2 * c.propagation;
+        c.timeout = factors[f] * roundTrip;
+        r = simulate(&c, ++runs);
+        printResult(&c, &r);
+    }
+    fprintf(stderr, "%lld configurations\n", runs);
+    return 0;
+}
@@ -0,0 +1,97 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "framepool.h"
+#include "hash.h"
+#include "packet.h"
+#include "spool.h"
+
+#define SPOOL_MAGIC "SPOL"
+
+void spoolHeader(unsigned char header[], const struct stat* st, uint64_t hash, long long count, long long indexOffset){
+    memcpy(header, SPOOL_MAGIC, 4);
+    putU32(header + 4, st->st_mtim.tv_nsec);
+    putU64(header + 8, st->st_size);
+    putU64(header + 16, st->st_mtim.tv_sec);
+    putU64(header + 24, hash);
+    putU64(header + 32, count);
+    putU64(header + 40, indexOffset);
+}
+
+int spoolOpen(struct spool* s, const char* name){
+    struct stat st;
+    memset(s, 0, sizeof(*s));
+    s->fd = open(name, O_RDONLY);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0 || st.st_size < SPOOL_HEADER_SIZE){
+        spoolClose(s);
+        return 0;
+    }
+    s->mapSize = st.st_size;
+    s->map = mmap(NULL, s->mapSize, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED){
+        s->map = NULL;
+        spoolClose(s);
+        return 0;
+    }
+
+    const unsigned char* header = s->map;
+    long long indexOffset = getU64(header + 40);
+    s->mtimeNsec = getU32(header + 4);
+    s->sourceSize = getU64(header + 8);
+    s->mtimeSec = getU64(header + 16);
+    s->sourceHash = getU64(header + 24);
+    s->count = getU64(header + 32);
+    if (memcmp(header, SPOOL_MAGIC, 4) != 0 || indexOffset < SPOOL_HEADER_SIZE ||
+        s->count < 0 || indexOffset + (s->count + 1) * 8 != (long long)s->mapSize){
+        spoolClose(s);
+        return 0;
+    }
+    s->index = s->map + indexOffset;
+
+    // Every frame has to lie inside the frame area and fit a pool slot
+    for (long long i = 0; i < s->count; i++){
+        int length;
+        if (spoolFrame(s, i, &length) == NULL){
+            spoolClose(s);
+            return 0;
+        }
+    }
+    madvise((void*)s->map, s->mapSize, MADV_SEQUENTIAL);
+    return 1;
+}
+
+// A spool is fresh when the source still has the size and mtime it was built
+// from. A changed mtime alone (a copy, a touch) falls back to the hash.
+int spoolFresh(const struct spool* s, int source){
+    struct stat st;
+    long long size;
+    uint64_t hash;
+    if (fstat(source, &st) < 0 || st.st_size != s->sourceSize)
+        return 0;
+    if (st.st_mtim.tv_sec == s->mtimeSec && st.st_mtim.tv_nsec == s->mtimeNsec)
+        return 1;
+    return hashFile(source, &size, &hash) && size == s->sourceSize && hash == s->sourceHash;
+}
+
+const unsigned char* spoolFrame(const struct spool* s, long long i, int* length){
+    long long start = getU64(s->index + i * 8);
+    long long end = getU64(s->index + i * 8 + 8);
+    if (start < SPOOL_HEADER_SIZE || end - start < 6 || end - start > FRAME_SIZE ||
+        end > s->index - s->map)
+        return NULL;
+    *length = end - start;
+    return s->map + start;
+}
+
+void spoolClose(struct spool* s){
+    if (s->map != NULL)
+        munmap((void*)s->map, s->mapSize);
+    if (s->fd >= 0)
+        close(s->fd);
+    memset(s, 0, sizeof(*s));
+    s->fd = -1;
+}
@@ -0,0 +1,41 @@
+// On-disk spool of pre-encoded I-frames
+//
+// makespool stuffs and checksums a file once; write_datalink --spool then
+// sends the frames straight from a mapping of the spool. Frames are stored
+// whole, but the 4-byte header is stamped at send time since Ns is only
+// known then.
+//
+// Layout, numbers big endian:
+//   "SPOL" | mtime ns (4) | source size (8) | mtime s (8) | source xxHash64 (8)
+//   | frame count (8) | index offset (8)
+//   frames, back to back
+//   index: count + 1 frame offsets (8 each), the last one is the end of the frames
+
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define SPOOL_HEADER_SIZE 48
+
+struct spool {
+    int fd;
+    const unsigned char* map;
+    size_t mapSize;
+    long long sourceSize;
+    long long mtimeSec;
+    long mtimeNsec;
+    uint64_t sourceHash;
+    long long count;
+    const unsigned char* index;
+};
+
+void spoolHeader(unsigned char header[], const struct stat* st, uint64_t hash, long long count, long long indexOffset);
+int spoolOpen(struct spool* s, const char* name);
+int spoolFresh(const struct spool* s, int source);
+const unsigned char* spoolFrame(const struct spool* s, long long i, int* length);
+void spoolClose(struct spool* s);
+
+#endif
@@ -0,0 +1,252 @@
+// Feeds hand-made frames through the frame parser and checks what it reports
+//
+// Usage: testparser
+// Prints each case and exits non-zero if any of them is misread. Every case
+// goes through parserFeed() and parserFeedGeneric(), with its input handed
+// over all at once and again in pieces of 1 and 5 bytes, so that frames and
+// escape sequences are split across calls. Most inputs are written out byte
+// by byte; the COBS ones are encoded with frameStuff() and frameClose().
+// The payload buffer is filled with SENTINEL before each frame, so a frame
+// skipped for its N(S) can be seen to leave it alone.
+//
+// Build: gcc -o testparser testparser.c frameparser.c framepool.c metrics.c trace.c ioengine.c
+
+#include <stdio.h>
+#include <string.h>
+
+#include "frameparser.h"
+#include "protocol.h"
+
+#define MAX_INPUT 2048
+#define MAX_FRAMES 4
+#define MAX_CASES 32
+#define SENTINEL 0xAA
+
+struct expectFrame {
+    int type;
+    int seq;
+    int bccOk;
+    int skipped;
+    int length;
+    const unsigned char* data; // payload to compare, NULL to skip the check
+};
+
+struct parserCase {
+    const char* name;
+    int framing;
+    unsigned char skip;          // the parser's skip set
+    unsigned char input[MAX_INPUT];
+    int len;
+    struct expectFrame frames[MAX_FRAMES];
+    int count;
+    long dataErrors;
+    long headerErrors;
+    long overflows;
+    long skipped;
+};
+
+struct parserCase cases[MAX_CASES];
+int caseCount = 0;
+
+struct parserCase* newCase(const char* name, int framing){
+    struct parserCase* c = &cases[caseCount++];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    c->framing = framing;
+    return c;
+}
+
+void addBytes(struct parserCase* c, const unsigned char* bytes, int len){
+    memcpy(c->input + c->len, bytes, len);
+    c->len += len;
+}
+
+void addRR(struct parserCase* c, int nr){
+    unsigned char rr[] = { FLAG, A_RES, C_RR(nr), A_RES ^ C_RR(nr), FLAG };
+    addBytes(c, rr, sizeof(rr));
+}
+
+// An I-frame encoded by the frame pool in the case's framing
+void addEncoded(struct parserCase* c, int ns, const unsigned char* data, int len){
+    struct frame f;
+    int n = 4;
+    unsigned char bcc = 0x00;
+    frameSetFraming(c->framing);
+    frameInfoHeader(f.data, ns);
+    f.code = 0;
+    if (frameStuff(&f, &n, data, len, &bcc) != len)
+        printf("%s: frame too small for %d bytes\n", c->name, len);
+    frameClose(&f, n, bcc);
+    frameSetFraming(FRAMING_HDLC);
+    addBytes(c, f.data, f.length);
+}
+
+void expect(struct parserCase* c, int type, int seq, int bccOk, int length, const unsigned char* data){
+    struct expectFrame* e = &c->frames[c->count++];
+    e->type = type;
+    e->seq = seq;
+    e->bccOk = bccOk;
+    e->length = length;
+    e->data = data;
+}
+
+// An I-frame the parser must pass over without storing its data
+void expectSkipped(struct parserCase* c, int seq){
+    expect(c, FRAME_I, seq, 1, 0, NULL);
+    c->frames[c->count - 1].skipped = 1;
+}
+
+static const unsigned char special[] = { FLAG, ESCAPE, 'A' };
+static const unsigned char flag[] = { FLAG };
+static unsigned char longData[300];
+
+void buildCases(){
+    struct parserCase* c;
+    for (int framing = FRAMING_HDLC; framing <= FRAMING_COBS; framing++){
+        // An I-frame cut right after BCC1 has no BCC2 to check its data against
+        c = newCase("I-frame without BCC2", framing);
+        addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(0), A_SET ^ C_I(0), FLAG }, 5);
+        expect(c, FRAME_I, 0, 0, 0, NULL);
+        c->dataErrors = 1;
+
+        c = newCase("RR", framing);
+        addRR(c, 1);
+        expect(c, FRAME_RR, 1, 1, 0, NULL);
+
+        // More than FRAME_SIZE bytes of data: dropped, and the next frame is read
+        c = newCase("payload overflow", framing);
+        addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(0), A_SET ^ C_I(0) }, 4);
+        for (int i = 0; i < FRAME_SIZE + 100; i++)
+            addBytes(c, (const unsigned char[]){ 'A' }, 1);
+        addBytes(c, (const unsigned char[]){ FLAG }, 1);
+        addRR(c, 1);
+        expect(c, FRAME_RR, 1, 1, 0, NULL);
+        c->overflows = 1;
+
+        // Line noise, a FLAG followed by no address and a header with a bad
+        // BCC1 all come before the frame the parser has to find
+        c = newCase("garbage before a frame", framing);
+        addBytes(c, (const unsigned char[]){ 'x', ESCAPE, A_SET, 0x00, FLAG, 0x55, 'y', FLAG, A_SET, C_I(1), 0x99, 'z' }, 12);
+        addEncoded(c, 2, (const unsigned char*)"ok", 2);
+        expect(c, FRAME_I, 2, 1, 2, (const unsigned char*)"ok");
+        c->headerErrors = 1;
+    }
+
+    c = newCase("I-frame with BCC2", FRAMING_HDLC);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(1), A_SET ^ C_I(1), 'A', 'B', 'A' ^ 'B', FLAG }, 8);
+    expect(c, FRAME_I, 1, 1, 2, (const unsigned char*)"AB");
+
+    c = newCase("I-frame with a bad BCC2", FRAMING_HDLC);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(0), A_SET ^ C_I(0), 'A', 'B', 'A', FLAG }, 8);
+    expect(c, FRAME_I, 0, 0, 2, NULL);
+    c->dataErrors = 1;
+
+    // FLAG and ESCAPE in the data go as ESCAPE and the byte XOR 0x20, and so
+    // does a BCC2 that comes out as one of them
+    c = newCase("stuffed data and BCC2", FRAMING_HDLC);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(0), A_SET ^ C_I(0),
+                                         ESCAPE, FLAG_ESCAPE, ESCAPE, ESCAPE_ESCAPE, 'A', FLAG ^ ESCAPE ^ 'A', FLAG }, 11);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(1), A_SET ^ C_I(1), ESCAPE, FLAG_ESCAPE, ESCAPE, FLAG_ESCAPE, FLAG }, 9);
+    expect(c, FRAME_I, 0, 1, 3, special);
+    expect(c, FRAME_I, 1, 1, 1, flag);
+
+    // ESCAPE right before a FLAG aborts the frame
+    c = newCase("aborted frame", FRAMING_HDLC);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(0), A_SET ^ C_I(0), 'A', ESCAPE, FLAG }, 7);
+    addRR(c, 1);
+    expect(c, FRAME_RR, 1, 1, 0, NULL);
+
+    // Under COBS the same bytes go unchanged, in blocks of up to 254
+    for (int i = 0; i < (int)sizeof(longData); i++)
+        longData[i] = i % 3 == 0 ? FLAG : i % 3 == 1 ? ESCAPE : i;
+    c = newCase("COBS I-frame with data", FRAMING_COBS);
+    addEncoded(c, 3, special, sizeof(special));
+    addEncoded(c, 4, longData, sizeof(longData));
+    addRR(c, 5);
+    expect(c, FRAME_I, 3, 1, sizeof(special), special);
+    expect(c, FRAME_I, 4, 1, sizeof(longData), longData);
+    expect(c, FRAME_RR, 5, 1, 0, NULL);
+
+    // A skipped frame is still read up to its FLAG, escapes and all, and the
+    // frame after it is stored as usual
+    c = newCase("skipped stuffed I-frame", FRAMING_HDLC);
+    c->skip = 1 << 1;
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(1), A_SET ^ C_I(1),
+                                         ESCAPE, FLAG_ESCAPE, ESCAPE, ESCAPE_ESCAPE, 'A', FLAG ^ ESCAPE ^ 'A', FLAG }, 11);
+    addBytes(c, (const unsigned char[]){ FLAG, A_SET, C_I(2), A_SET ^ C_I(2), 'A', 'B', 'A' ^ 'B', FLAG }, 8);
+    expectSkipped(c, 1);
+    expect(c, FRAME_I, 2, 1, 2, (const unsigned char*)"AB");
+    c->skipped = 1;
+
+    c = newCase("skipped COBS I-frame", FRAMING_COBS);
+    c->skip = 1 << 1 | 1 << 3;
+    addEncoded(c, 1, longData, sizeof(longData));
+    addEncoded(c, 2, special, sizeof(special));
+    addEncoded(c, 3, special, sizeof(special));
+    addRR(c, 4);
+    expectSkipped(c, 1);
+    expect(c, FRAME_I, 2, 1, sizeof(special), special);
+    expectSkipped(c, 3);
+    expect(c, FRAME_RR, 4, 1, 0, NULL);
+    c->skipped = 2;
+}
+
+// Feeds the case in pieces of chunk bytes (all at once for 0) and compares
+// every frame reported, as it is reported
+int runCase(const struct parserCase* c, int generic, int chunk){
+    unsigned char payload[FRAME_SIZE];
+    struct frameParser parser;
+    struct frameInfo info;
+    parserInit(&parser, payload, sizeof(payload));
+    parser.framing = c->framing;
+    parser.skip = c->skip;
+    memset(payload, SENTINEL, sizeof(payload));
+    int pos = 0, got = 0, ok = 1;
+    while (pos < c->len){
+        int len = chunk > 0 && chunk < c->len - pos ? chunk : c->len - pos;
+        memset(&info, 0, sizeof(info));
+        pos += generic ? parserFeedGeneric(&parser, c->input + pos, len, &info)
+                       : parserFeed(&parser, c->input + pos, len, &info);
+        if (info.type == FRAME_NONE)
+            continue;
+        if (got == c->count){
+            printf("     unexpected %s frame\n", frameTypeName(info.type));
+            ok = 0;
+            continue;
+        }
+        const struct expectFrame* e = &c->frames[got++];
+        int stored = 0;
+        while (stored < FRAME_SIZE && payload[stored] != SENTINEL)
+            stored++;
+        if (info.type != e->type || info.seq != e->seq || info.bccOk != e->bccOk || info.skipped != e->skipped ||
+            info.length != e->length || (e->data != NULL && memcmp(info.payload, e->data, e->length) != 0) ||
+            (e->skipped && stored > 0)){
+            printf("     frame %d: %s seq %d bccOk %d skipped %d length %d\n", got, frameTypeName(info.type),
+                   info.seq, info.bccOk, info.skipped, info.length);
+            ok = 0;
+        }
+        memset(payload, SENTINEL, sizeof(payload));
+    }
+    ok = ok && got == c->count && parser.stats.dataErrors == c->dataErrors &&
+         parser.stats.headerErrors == c->headerErrors && parser.stats.overflows == c->overflows &&
+         parser.stats.skipped == c->skipped;
+    printf("%-4s %-24s %-5s %-7s in %s: %d frames, data errors %ld, header errors %ld, overflows %ld, skipped %ld\n",
+           ok ? "ok" : "FAIL", c->name, c->framing == FRAMING_COBS ? "cobs" : "hdlc",
+           generic ? "generic" : "profile", chunk == 0 ? "one call" : chunk == 1 ? "bytes" : "pieces",
+           got, parser.stats.dataErrors, parser.stats.headerErrors, parser.stats.overflows,
+           parser.stats.skipped);
+    return ok;
+}
+
+int main(){
+    const int chunks[] = { 0, 1, 5 };
+    int failed = 0;
+    buildCases();
+    for (int i = 0; i < caseCount; i++)
+        for (int generic = 0; generic < 2; generic++)
+            for (int k = 0; k < (int)(sizeof(chunks) / sizeof(chunks[0])); k++)
+                failed += !runCase(&cases[i], generic, chunks[k]);
+    if (failed > 0)
+        printf("%d case(s) failed\n", failed);
+    return failed > 0;
+}
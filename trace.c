@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "packet.h"
+#include "trace.h"
+
+#define TRACE_MAGIC "WTRC"
+
+static FILE* trace = NULL;
+static long long lastTime;
+
+static long long monotonicNs(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void putVarint(unsigned long long v){
+    unsigned char buf[10];
+    int n = 0;
+    do {
+        buf[n] = v & 0x7F;
+        v >>= 7;
+        if (v != 0)
+            buf[n] |= 0x80;
+        n++;
+    } while (v != 0);
+    fwrite(buf, 1, n, trace);
+}
+
+// Starts a capture when DATALINK_TRACE names a file. Returns 0 only if it
+// was asked for and cannot be written.
+int traceStart(){
+    const char* name = getenv("DATALINK_TRACE");
+    unsigned char header[TRACE_HEADER_SIZE] = {0};
+    struct timespec wall;
+    if (name == NULL || *name == '\0' || trace != NULL)
+        return 1;
+    trace = fopen(name, "wb");
+    if (trace == NULL){
+        perror(name);
+        return 0;
+    }
+    // A large stdio buffer keeps the capture to one write() every few hundred frames
+    setvbuf(trace, NULL, _IOFBF, 1 << 16);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    memcpy(header, TRACE_MAGIC, 4);
+    header[4] = TRACE_VERSION;
+    putU64(header + 8, wall.tv_sec * 1000000000ULL + wall.tv_nsec);
+    fwrite(header, 1, sizeof(header), trace);
+    lastTime = monotonicNs();
+    atexit(traceClose);
+    return 1;
+}
+
+static void recordHeader(int direction, int len){
+    long long now = monotonicNs();
+    fputc(direction, trace);
+    putVarint(now - lastTime);
+    putVarint(len);
+    lastTime = now;
+}
+
+void traceRecord(int direction, const unsigned char* data, int len){
+    if (trace == NULL || len <= 0)
+        return;
+    recordHeader(direction, len);
+    fwrite(data, 1, len, trace);
+}
+
+// One record for the whole writev, as it was one system call
+void traceRecordv(int direction, const struct iovec* iov, int count){
+    int len = 0;
+    if (trace == NULL)
+        return;
+    for (int i = 0; i < count; i++)
+        len += iov[i].iov_len;
+    if (len <= 0)
+        return;
+    recordHeader(direction, len);
+    for (int i = 0; i < count; i++)
+        fwrite(iov[i].iov_base, 1, iov[i].iov_len, trace);
+}
+
+void traceClose(){
+    if (trace == NULL)
+        return;
+    fclose(trace);
+    trace = NULL;
+}
+
+// Replay side: the capture is read into memory once, so replays measure the
+// parser and not the disk
+int traceLoad(struct traceCursor* c, const char* name){
+    FILE* in = fopen(name, "rb");
+    memset(c, 0, sizeof(*c));
+    if (in == NULL)
+        return 0;
+    fseek(in, 0, SEEK_END);
+    c->size = ftell(in);
+    rewind(in);
+    unsigned char* data = malloc(c->size > 0 ? c->size : 1);
+    if (data == NULL || fread(data, 1, c->size, in) != (size_t)c->size ||
+        c->size < TRACE_HEADER_SIZE || memcmp(data, TRACE_MAGIC, 4) != 0 || data[4] != TRACE_VERSION){
+        free(data);
+        fclose(in);
+        memset(c, 0, sizeof(*c));
+        return 0;
+    }
+    fclose(in);
+    c->data = data;
+    c->startWallClock = getU64(data + 8);
+    traceRewind(c);
+    return 1;
+}
+
+static int getVarint(struct traceCursor* c, unsigned long long* v){
+    *v = 0;
+    for (int shift = 0; shift < 64 && c->pos < c->size; shift += 7){
+        unsigned char byte = c->data[c->pos++];
+        *v |= (unsigned long long)(byte & 0x7F) << shift;
+        if (!(byte & 0x80))
+            return 1;
+    }
+    return 0;
+}
+
+// Returns 0 at the end of the capture, or at a record cut short when the
+// program died mid-write
+int traceNext(struct traceCursor* c, struct traceEntry* e){
+    unsigned long long delta, len;
+    if (c->pos >= c->size)
+        return 0;
+    e->direction = c->data[c->pos++];
+    if (!getVarint(c, &delta) || !getVarint(c, &len) || len > (unsigned long long)(c->size - c->pos))
+        return 0;
+    c->time += delta;
+    e->time = c->time;
+    e->length = len;
+    e->data = c->data + c->pos;
+    c->pos += len;
+    return 1;
+}
+
+void traceRewind(struct traceCursor* c){
+    c->pos = TRACE_HEADER_SIZE;
+    c->time = 0;
+}
+
+void traceFree(struct traceCursor* c){
+    free((void*)c->data);
+    memset(c, 0, sizeof(*c));
+}
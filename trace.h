@@ -0,0 +1,49 @@
+// Binary capture of everything read from and written to the serial port
+//
+// Set DATALINK_TRACE=<file> and both programs record each read and write
+// with a monotonic timestamp and its direction (give each program its own
+// file). replaytrace feeds a capture back through the frame parser, so field
+// sessions become reproducible parser benchmarks.
+//
+// Layout:
+//   "WTRC" | version (1) | 0 (3) | wall clock at start, ns (8, big endian)
+//   records: direction (1) | ns since the previous record (varint)
+//            | length (varint) | bytes
+// Varints are LEB128, 7 bits per byte, low bits first.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <sys/uio.h>
+
+#define TRACE_IN 0  // read from the port
+#define TRACE_OUT 1 // written to the port
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+
+struct traceEntry {
+    int direction;
+    long long time; // ns since the start of the capture
+    int length;
+    const unsigned char* data;
+};
+
+struct traceCursor {
+    const unsigned char* data;
+    long long size;
+    long long pos;
+    long long time;
+    long long startWallClock;
+};
+
+int traceStart();
+void traceRecord(int direction, const unsigned char* data, int len);
+void traceRecordv(int direction, const struct iovec* iov, int count);
+void traceClose();
+
+int traceLoad(struct traceCursor* c, const char* name);
+int traceNext(struct traceCursor* c, struct traceEntry* e);
+void traceRewind(struct traceCursor* c);
+void traceFree(struct traceCursor* c);
+
+#endif
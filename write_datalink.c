@@ -1,17 +1,41 @@
 // Write to serial port in non-canonical mode
 //
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
+//
+// Build: gcc -o write_datalink write_datalink.c framepool.c frameparser.c framesource.c framesink.c hash.c delta.c spool.c metrics.c trace.c arq.c ioengine.c realtime.c duplex.c encoder.c -pthread
+
+#define _FILE_OFFSET_BITS 64
 
+#include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <termios.h>
 #include <unistd.h>
 
+#include "framepool.h"
+#include "frameparser.h"
+#include "arq.h"
+#include "delta.h"
+#include "duplex.h"
+#include "encoder.h"
+#include "framesource.h"
+#include "metrics.h"
+#include "hash.h"
+#include "ioengine.h"
+#include "packet.h"
+#include "probes.h"
+#include "protocol.h"
+#include "realtime.h"
+#include "spool.h"
+#include "trace.h"
+
 // Baudrate settings are defined in <asm/termbits.h>, which is
 // included by <termios.h>
 #define BAUDRATE B38400
@@ -20,58 +44,36 @@
 #define FALSE 0
 #define TRUE 1
 
-#define C_SET 0x03
-#define A_SET 0x03
-#define A_RES 0x01
-#define C_DISC 0x0B
-#define C_UA 0x07
-#define FLAG 0x7E
-#define C_RR_NR0 0x05
-#define C_RR_NR1 0x85
-#define C_REJ_NR0 0x01
-#define C_REJ_NR1 0x81
-
-#define BUFFER_SIZE 245
-
-int checkSupervision(unsigned char* buf, int length, u_int8_t ctrField);
-void clearBuffer(unsigned char buf[]);
-int next_block_size(int count, int buffer_size);
-void infoTrama(unsigned char buf[]);
-void swap();
-
-int readByByte(unsigned char buf[], int fd){
-    unsigned char x[1];
-    printf("\n");
-    for(int i = 0; i<500; i++){
-        if(read(fd, x, 1)){
-            printf("x%d %d   ", i, x[0]);
-            buf[i] = x[0];
-        }
-        else return 0;
+#define FRAME_POOL_SIZE 8 // the whole window in flight, and at least one frame prepared ahead
+
+// Link parameters. Stop-and-wait unless DATALINK_ARQ asks for a Go-Back-N or
+// Selective Repeat window over 3-bit sequence numbers (see arq.h).
+#define WINDOW 1
+#define MODULUS 2
+#define RETRANSMIT_TIMEOUT_MS 5000
+#define MAX_RETRIES 2 // the third timeout in a row gives the link up
+#define DUPLEX_POLL_MS 50 // with --receive, how long a quiet port is waited on before the input is looked at again
+
+void infoTrama(unsigned char buf[], long long seq);
+int preparePacket(unsigned char packet[], int* used, struct frameSource* src, int block);
+void fillPool(struct frameSource* src, int block);
+
+// Waits up to ms for one of the two expected frame types. Leftovers such as
+// the UA of a repeated SET are skipped.
+int waitFor(struct frameReader* r, struct frameInfo* info, int type1, int type2, int ms){
+    while (readFrameTimeout(r, info, ms)){
+        if (info->type == type1 || info->type == type2)
+            return 1;
+        printf("Ignoring %s frame\n", frameTypeName(info->type));
     }
-    return 1;
+    return 0;
 }
 
 
-
-int next_block_size(int count, int buffer_size) {
-return (count >= buffer_size)? buffer_size: count % buffer_size;
-}
-
 volatile int STOP = FALSE;
 
 int alarmEnabled = FALSE;
 int alarmCount;
-int Nr = 1;
-int Ns = 0;
-
-void swap(){
-    if (Ns) Ns = 0;
-    else Ns = 1;
-
-    if (Nr) Nr = 0;
-    else Nr = 1;
- }
 
 // Alarm function handler
 void alarmHandler(int signal)
@@ -82,28 +84,322 @@ void alarmHandler(int signal)
         printf("Alarm #%d\n", alarmCount);
 }
 
-void clearBuffer(unsigned char buf[]){
-    for (int i = 0; i < 500; i++){
-        buf[i] = 0;
+// Frames are prepared ahead while earlier ones wait for their RR. The head
+// of the ring is the oldest frame not acknowledged (arq.base) and any frame
+// from there can be resent on REJ/SREJ/timeout, so the ring is also the
+// whole retransmission buffer.
+struct arqSender arq;
+struct ioEngine io;
+struct frame* pool[FRAME_POOL_SIZE];
+long long sentAt[FRAME_POOL_SIZE];
+int poolHead = 0;
+int poolReady = 0;
+int endQueued = FALSE;
+
+// DATALINK_WORKERS encodes the frames on that many threads, see encoder.h
+struct encoder encoder;
+
+// With --receive the receiver sends a file back, and every I-frame
+// acknowledges what has arrived of it so far
+int duplexMode = FALSE;
+struct duplexReceive reverse;
+
+void infoTrama(unsigned char buf[], long long seq){
+    if (duplexMode)
+        frameInfoHeaderAck(buf, A_SET, seq % arq.config.modulus, duplexReceiveNr(&reverse));
+    else
+        frameInfoHeader(buf, seq % arq.config.modulus);
+}
+
+// The input is hashed as it is read. Each finished block is followed by its
+// BLOCKHASH packet so the receiver can point at the blocks that went bad.
+struct blockHasher hasher;
+int hashPending = FALSE;
+
+// Repair mode resends only the ranges listed in a .bad file from the receiver
+FILE* ranges = NULL;
+int rangesDone = FALSE;
+long long fileSize = 0;
+uint64_t fileHash = 0;
+
+// Delta mode maps the input and sends only what the receiver's basis, as
+// described by its signature, does not already hold
+int deltaMode = FALSE;
+struct signature sig;
+struct deltaScan scan;
+struct deltaPiece piece;
+long long deltaLiteral = 0;
+long long deltaCopied = 0;
+
+// Spool mode sends frames makespool encoded ahead of time, straight from a
+// mapping of the spool. Frame seq of the transfer is spool frame seq.
+int spoolMode = FALSE;
+struct spool spool;
+
+// DATALINK_VERBOSE=1 echoes every new frame, its N(S) and each RR to stdout
+int verbose = FALSE;
+
+// Builds the BLOCKHASH packet of the block being hashed and moves on to the next
+int blockHashPacket(unsigned char packet[]){
+    packet[0] = PKT_BLOCKHASH;
+    putU64(packet + 1, hasher.blockIndex);
+    putU64(packet + 9, xxh64Digest(&hasher.block));
+    hasherStartBlock(&hasher, hasher.blockIndex + 1);
+    return PKT_BLOCKHASH_SIZE;
+}
+
+// Moves the input to the next range to repair and builds its SEEK packet
+int nextRange(struct frameSource* src, unsigned char packet[]){
+    long long offset, length;
+    if (fscanf(ranges, "%lld %lld", &offset, &length) != 2 || !sourceSeek(src, offset, length)){
+        rangesDone = TRUE;
+        return 0;
     }
+    packet[0] = PKT_SEEK;
+    putU64(packet + 1, offset);
+    hasherStartBlock(&hasher, offset / HASH_BLOCK_SIZE);
+    return 1;
+}
+
+// Reads the next packet into packet, cut where its I-frame will be full, and
+// returns its length, 0 when there is nothing to send yet. *used is the file
+// bytes it carries. Once the input is exhausted the END packet is queued.
+int preparePacket(unsigned char packet[], int* used, struct frameSource* src, int block){
+    int packetSize = 0;
+    int available = (hashPending || deltaMode) ? 0 : sourceFill(src, block);
+    *used = 0;
+
+    // DATA never crosses a block, so each BLOCKHASH covers whole packets
+    if (available > hasherBlockLeft(&hasher))
+        available = hasherBlockLeft(&hasher);
+
+    if (hashPending){
+        packetSize = blockHashPacket(packet);
+        hashPending = FALSE;
+    }
+    else if (deltaMode && (piece.length > 0 || deltaNext(&scan, &sig, &piece))){
+        long long n = piece.length;
+        if (n > hasherBlockLeft(&hasher))
+            n = hasherBlockLeft(&hasher);
+        if (piece.type != DELTA_LITERAL && n > PKT_COPY_MAX)
+            n = PKT_COPY_MAX;
+        if (piece.type == DELTA_LITERAL){
+            packetSize = packetData(packet, scan.src + piece.srcOffset, n, used);
+            deltaLiteral += *used;
+        }
+        else {
+            packet[0] = PKT_COPY;
+            putU64(packet + 1, piece.basisOffset);
+            putU32(packet + 9, n);
+            packetSize = PKT_COPY_SIZE;
+            *used = n;
+            deltaCopied += *used;
+        }
+        hasherUpdate(&hasher, scan.src + piece.srcOffset, *used);
+        piece.srcOffset += *used;
+        piece.basisOffset += *used;
+        piece.length -= *used;
+        hashPending = hasherBlockLeft(&hasher) == 0;
+    }
+    else if (available > 0){
+        packetSize = packetData(packet, src->buf + src->pos, available, used);
+        hasherUpdate(&hasher, src->buf + src->pos, *used);
+        sourceConsume(src, *used);
+        hashPending = hasherBlockLeft(&hasher) == 0;
+    }
+    else if (!src->eof)
+        return 0;
+    else if (hasher.blockFill > 0)
+        packetSize = blockHashPacket(packet);
+    else if (ranges != NULL && !rangesDone && nextRange(src, packet))
+        packetSize = PKT_SEEK_SIZE;
+    else if (!endQueued){
+        if (ranges != NULL)
+            packetSize = packetEnd(packet, fileSize, fileHash);
+        else if (deltaMode)
+            packetSize = packetEnd(packet, scan.size, xxh64Digest(&hasher.whole));
+        else
+            packetSize = packetEnd(packet, src->total, xxh64Digest(&hasher.whole));
+        endQueued = TRUE;
+    }
+    return packetSize;
+}
+
+// Producer stage: tops up the ring with ready frames. With DATALINK_WORKERS
+// the packets go to the encoder's threads and their frames join the ring in
+// order once encoded. A blocking fill returns with at least one new frame,
+// unless the input is done.
+void fillPool(struct frameSource* src, int block){
+    unsigned char packet[FRAME_SIZE];
+    int added = 0;
+    while (!endQueued && (encoder.workers > 0 ? encoderRoom(&encoder) > 0 : poolReady < FRAME_POOL_SIZE)){
+        struct frame* f = frameAcquire();
+        if (f == NULL)
+            break;
+        long long start = metricsNow();
+        int wait = block && added == 0 && encoderPending(&encoder) == 0;
+        int length = preparePacket(packet, &f->payload, src, wait);
+        if (length == 0){
+            frameRelease(f);
+            break;
+        }
+        if (encoder.workers > 0)
+            encoderSubmit(&encoder, f, packet, length);
+        else {
+            encodePacket(f, packet, length);
+            pool[(poolHead + poolReady) % FRAME_POOL_SIZE] = f;
+            poolReady++;
+            added++;
+        }
+        // A blocking fill also waits for the input, which is not encoding time
+        if (!wait)
+            histogramRecord(&metrics.processing, metricsNow() - start);
+    }
+    struct frame* f;
+    while (poolReady < FRAME_POOL_SIZE && (f = encoderCollect(&encoder, block && added == 0)) != NULL){
+        pool[(poolHead + poolReady) % FRAME_POOL_SIZE] = f;
+        poolReady++;
+        added++;
+    }
+}
+
+// Frame seq is in the ring, or in the spool
+int frameReady(long long seq){
+    if (spoolMode)
+        return seq < spool.count;
+    return seq - arq.base < poolReady;
+}
+
+// Stamps the header and queues frame seq for the port. Spool frames are
+// queued straight from the mapping, without being copied into a pool slot.
+// Returns the bytes queued, or -1 when the port would not take them
+int queueFrame(long long seq){
+    long long now = metricsNow();
+    if (spoolMode){
+        unsigned char header[4];
+        int length;
+        const unsigned char* data = spoolFrame(&spool, seq, &length);
+        struct iovec iov[2];
+        infoTrama(header, seq);
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = (void*)(data + 4);
+        iov[1].iov_len = length - 4;
+        if (ioQueuev(&io, iov, 2) < 0)
+            return -1;
+        sentAt[seq % FRAME_POOL_SIZE] = now;
+        traceRecordv(TRACE_OUT, iov, 2);
+        metricAdd(framesSent, 1);
+        metricAdd(wireBytesOut, length);
+        linkProbe3(frame_sent, seq, length, now);
+        return length;
+    }
+    struct frame* f = pool[(poolHead + seq - arq.base) % FRAME_POOL_SIZE];
+    infoTrama(f->data, seq);
+    struct iovec iov = { .iov_base = f->data, .iov_len = f->length };
+    if (ioQueuev(&io, &iov, 1) < 0)
+        return -1;
+    sentAt[seq % FRAME_POOL_SIZE] = now;
+    traceRecord(TRACE_OUT, f->data, f->length);
+    metricAdd(framesSent, 1);
+    metricAdd(wireBytesOut, f->length);
+    linkProbe3(frame_sent, seq, f->length, now);
+    return f->length;
+}
+
+// Supervision frames count towards the wire bytes too
+void writeControl(struct frame* control){
+    ioWrite(&io, control->data, control->length);
+    traceRecord(TRACE_OUT, control->data, control->length);
+    metricAdd(framesSent, 1);
+    metricAdd(wireBytesOut, control->length);
 }
 
-void trama(u_int8_t a,u_int8_t b,u_int8_t c,u_int8_t d,u_int8_t e,unsigned char buf[]){
-    buf[0] = a;
-    buf[1] = b;
-    buf[2] = c;
-    buf[3] = d;
-    buf[4] = e;
+void sendControl(struct frame* control, unsigned char c){
+    frameSupervision(control, A_SET, c);
+    writeControl(control);
 }
 
-void infoTrama(unsigned char buf[]){
-    buf[0] = FLAG;
-    buf[1] = A_SET;
-    if (Ns == 1)
-        buf[2] = 0x40;
+// SET, with the option byte when there is anything to ask for, followed by
+// the ARQ byte under OPTION_ARQ
+void sendSet(struct frame* control, unsigned char options, unsigned char arqOption){
+    unsigned char bytes[2] = { options, arqOption };
+    if (options == 0)
+        frameSupervision(control, A_SET, C_SET);
     else
-        buf[2] = 0x00;
-    buf[3] = buf[1] ^ buf[2];
+        frameOptions(control, A_SET, C_SET, bytes, (options & OPTION_ARQ) ? 2 : 1);
+    writeControl(control);
+}
+
+// Everything the window allows goes to the port in one write. The timers
+// start when the last byte is estimated to leave the wire, not when the
+// write returns.
+void sendWindow(){
+    long long seq;
+    int queued = 0;
+    while ((seq = arqSenderPick(&arq)) >= 0 && frameReady(seq)){
+        int length = queueFrame(seq);
+        // A full port is left to drain while the main loop reads replies
+        if (length < 0 && errno == EAGAIN)
+            break;
+        if (length < 0){
+            perror("write");
+            exit(-1);
+        }
+        if (seq < arq.highest)
+            metricAdd(retransmissions, 1);
+        else if (verbose && !spoolMode){
+            struct frame* f = pool[(poolHead + seq - arq.base) % FRAME_POOL_SIZE];
+            fwrite(f->data, 1, length, stdout);
+        }
+        if (verbose)
+            printf("\n Ns = %lld \n", seq % arq.config.modulus);
+        arqSenderSent(&arq, seq);
+        queued++;
+    }
+    if (queued > 0){
+        if (ioFlush(&io) < 0){
+            perror("write");
+            exit(-1);
+        }
+        arqSenderDeparted(&arq, metricsNow() + ioDrainTime(&io));
+    }
+}
+
+// Takes an I-frame of the reverse stream and answers it. An RR is left out
+// when one of our own I-frames can go right away, since it carries the same
+// N(R), except under stop-and-wait (see duplexSendCanSend()); REJ and SREJ
+// always go out.
+void receiveReverse(struct frame* control, struct frameInfo* info, const char* name){
+    int replyType, replySeq;
+    if (!duplexReceiveFrame(&reverse, info, &replyType, &replySeq)){
+        perror(name);
+        exit(-1);
+    }
+    long long seq = arqSenderPick(&arq);
+    if (replyType == FRAME_RR && arq.config.window > 1 && seq >= 0 && frameReady(seq)){
+        metricAdd(piggybacked, 1);
+        return;
+    }
+    if (replyType == FRAME_RR)
+        frameSupervision(control, A_RES, C_RR(replySeq));
+    else if (replyType == FRAME_REJ)
+        frameSupervision(control, A_RES, C_REJ(replySeq));
+    else if (replyType == FRAME_SREJ)
+        frameSupervision(control, A_RES, C_SREJ(replySeq));
+    else
+        return;
+    writeControl(control);
+}
+
+// Drops the acknowledged head of the ring. Called before arq.base moves on.
+void advanceHead(){
+    if (spoolMode)
+        return;
+    metricAdd(payloadBytesOut, pool[poolHead]->payload);
+    frameRelease(pool[poolHead]);
+    poolHead = (poolHead + 1) % FRAME_POOL_SIZE;
+    poolReady--;
 }
 
 int main(int argc, char *argv[])
@@ -114,33 +410,156 @@ int main(int argc, char *argv[])
     if (argc < 3)
     {
         printf("Incorrect program usage\n"
-               "Usage: %s <SerialPort> <filename.txt>\n"
-               "Example: %s /dev/ttyS1 text.txt\n",
+               "Usage: %s <SerialPort> <filename.txt | -> [--ranges <file.bad> | --delta <signature> | --spool <spool>] [--receive <file>]\n"
+               "Example: %s /dev/ttyS1 text.txt\n"
+               "         tar c dir | %s /dev/ttyS1 -\n"
+               "         %s /dev/ttyS1 text.txt --ranges text.txt.bad\n"
+               "         %s /dev/ttyS1 text.txt --delta text-old.sig\n"
+               "         %s /dev/ttyS1 text.txt --spool text.spool\n"
+               "         %s /dev/ttyS1 text.txt --receive reply.txt\n"
+               "         %s /dev/ttyS1 text.txt --receive - | less\n",
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
+               argv[0],
                argv[0],
                argv[0]);
         exit(1);
     }
 
+    /* with --receive the receiver's file comes back over the same link, and
+       "-" streams it to stdout, which must then carry nothing else */
+    const char* receiveName = NULL;
+    for (int i = 3; i + 1 < argc; i++)
+        if (strcmp(argv[i], "--receive") == 0)
+            receiveName = argv[i + 1];
+    if (receiveName != NULL && strcmp(receiveName, "-") == 0 && !sinkClaimStdout()){
+        perror("stdout");
+        exit(1);
+    }
+
+    // DATALINK_RT locks memory and raises priority, before any file is mapped
+    if (!realtimeStart())
+        exit(1);
+
+    // DATALINK_ARQ picks the window and how errors are recovered
+    struct arqConfig config = {
+        .window = WINDOW,
+        .modulus = MODULUS,
+        .timeout = RETRANSMIT_TIMEOUT_MS * 1000000LL,
+        .policy = ARQ_TIMEOUT_FIXED,
+        .maxRetries = MAX_RETRIES,
+        .mode = ARQ_GO_BACK_N,
+    };
+    if (!arqConfigFromEnv(&config))
+        exit(1);
+    int workers;
+    if (!encoderWorkersFromEnv(&workers))
+        exit(1);
+    if (!sinkConfigFromEnv())
+        exit(1);
 
-    /* check if file can be opened and is readable */
-    int file = open(argv[2], O_RDONLY);
-    if (file == -1) {
-        printf("error: cannot open %s\n", argv[1]);
+    // DATALINK_FRAMING=cobs asks the receiver for COBS instead of byte stuffing
+    const char* wantFraming = getenv("DATALINK_FRAMING");
+    unsigned char framing = FRAMING_HDLC;
+    if (wantFraming != NULL && strcmp(wantFraming, "cobs") == 0)
+        framing = FRAMING_COBS;
+    else if (wantFraming != NULL && *wantFraming != '\0' && strcmp(wantFraming, "hdlc") != 0){
+        printf("DATALINK_FRAMING must be hdlc or cobs, not %s\n", wantFraming);
+        exit(1);
+    }
+
+    // DATALINK_FASTOPEN=1 sends the first window of I-frames right behind
+    // the SET instead of after the UA
+    const char* wantFastOpen = getenv("DATALINK_FASTOPEN");
+    int fastOpen = FALSE;
+    if (wantFastOpen != NULL && strcmp(wantFastOpen, "1") == 0)
+        fastOpen = TRUE;
+    else if (wantFastOpen != NULL && *wantFastOpen != '\0' && strcmp(wantFastOpen, "0") != 0){
+        printf("DATALINK_FASTOPEN must be 0 or 1, not %s\n", wantFastOpen);
+        exit(1);
+    }
+
+    const char* wantVerbose = getenv("DATALINK_VERBOSE");
+    if (wantVerbose != NULL && strcmp(wantVerbose, "1") == 0)
+        verbose = TRUE;
+    else if (wantVerbose != NULL && *wantVerbose != '\0' && strcmp(wantVerbose, "0") != 0){
+        printf("DATALINK_VERBOSE must be 0 or 1, not %s\n", wantVerbose);
+        exit(1);
+    }
+
+    if (receiveName != NULL && !duplexReceiveOpen(&reverse, receiveName, &config)) {
+        perror(receiveName);
         return EXIT_FAILURE;
     }
 
-    /* get the file size */
-    struct stat info;
-    int ret = lstat(argv[2], &info);
-    if (ret == -1) {
-        printf("error: cannot stat %s\n", argv[2]);
+    /* check if the input can be opened, "-" is stdin */
+    struct frameSource src;
+    if (!sourceOpen(&src, argv[2])) {
+        printf("error: cannot open %s\n", argv[2]);
         return EXIT_FAILURE;
     }
+    hasherInit(&hasher);
+
+    /* with --ranges only the listed ranges are sent again */
+    if (argc > 4 && strcmp(argv[3], "--ranges") == 0) {
+        ranges = fopen(argv[4], "r");
+        if (ranges == NULL || !hashFile(src.fd, &fileSize, &fileHash)) {
+            printf("error: cannot repair %s from %s\n", argv[2], argv[4]);
+            return EXIT_FAILURE;
+        }
+        sourceSeek(&src, 0, 0);
+    }
+
+    /* with --delta the input is matched against the receiver's signature */
+    if (argc > 4 && strcmp(argv[3], "--delta") == 0) {
+        struct stat st;
+        if (!signatureLoad(&sig, argv[4]) || fstat(src.fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+            printf("error: cannot send %s as a delta against %s\n", argv[2], argv[4]);
+            return EXIT_FAILURE;
+        }
+        const unsigned char* map = NULL;
+        if (st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, src.fd, 0);
+            if (map == MAP_FAILED) {
+                perror(argv[2]);
+                return EXIT_FAILURE;
+            }
+            madvise((void*)map, st.st_size, MADV_SEQUENTIAL);
+        }
+        deltaInit(&scan, map, st.st_size);
+        deltaMode = TRUE;
+        src.eof = TRUE;
+    }
+
+    /* with --spool the frames come pre-encoded, unless the input changed since */
+    if (argc > 4 && strcmp(argv[3], "--spool") == 0) {
+        if (!spoolOpen(&spool, argv[4])) {
+            printf("error: cannot open spool %s\n", argv[4]);
+            return EXIT_FAILURE;
+        }
+        if (spoolFresh(&spool, src.fd)) {
+            spoolMode = TRUE;
+            endQueued = TRUE;
+            if (framing != FRAMING_HDLC) {
+                printf("Spool frames are byte stuffed, not asking for COBS\n");
+                framing = FRAMING_HDLC;
+            }
+        }
+        else {
+            printf("Spool %s is stale, encoding %s live\n", argv[4], argv[2]);
+            spoolClose(&spool);
+        }
+    }
 
+    // COBS only starts once the UA agrees to it, too late for early frames
+    if (fastOpen && framing != FRAMING_HDLC){
+        printf("COBS is agreed in the UA, not sending data with the SET\n");
+        fastOpen = FALSE;
+    }
 
-    int count = info.st_size;
-    printf("real - %i\n", count);
-    char buffer[BUFFER_SIZE];
     // Open serial port device for reading and writing, and not as controlling tty
     // because we don't want to get killed if linenoise sends CTRL-C.
     int fd = open(serialPortName, O_RDWR | O_NOCTTY);
@@ -192,9 +611,20 @@ int main(int argc, char *argv[])
 
     printf("New termios structure set\n");
 
-    // Create string to send
-    unsigned char buf[500];
-    trama(FLAG,A_SET,C_SET,A_SET ^ C_SET,FLAG,buf);
+    if (!framePoolInit()){
+        printf("error: cannot allocate frame pool\n");
+        exit(-1);
+    }
+    metricsInit("write_datalink");
+    if (!traceStart())
+        exit(-1);
+
+    // Replies are parsed into reply, supervision frames go out from control
+    unsigned char replyData[FRAME_SIZE];
+    struct frameReader reader;
+    struct frameInfo reply;
+    readerInit(&reader, fd, replyData, sizeof(replyData));
+    struct frame* control = frameAcquire();
     
     // In non-canonical mode, '\n' does not end the writing.
     // Test this condition by placing a '\n' in the middle of the buffer.
@@ -205,178 +635,238 @@ int main(int argc, char *argv[])
     int cycle = 0;
     int state = 0;
     int disconnectReceiver = 0;
-    int connectionBad = 0;
     alarmCount = 0;
-    unsigned char repeat[500];
     int flags = fcntl(fd, F_GETFL, 0);
     fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-    while (alarmCount <3 && disconnectReceiver == 0)
+    if (!ioEngineInit(&io, fd))
+        exit(-1);
+    reader.io = &io;
+    printf("Serial I/O through %s\n", ioEngineName(&io));
+    printf("ARQ %s, window %d\n", arqModeName(&config), config.window);
+    if (workers > 0 && !spoolMode){
+        if (!encoderStart(&encoder, workers)){
+            printf("error: cannot start %d encoding threads\n", workers);
+            exit(-1);
+        }
+        printf("Encoding on %d threads\n", workers);
+    }
+
+    // Connection: SET until UA, giving up after three alarms. With fast open
+    // every SET is followed by the frames the window allows, from the first.
+    arqSenderInit(&arq, &config);
+    unsigned char arqOption = arqConfigOption(&config);
+    unsigned char options = framing | (receiveName != NULL ? OPTION_DUPLEX : 0) | (fastOpen ? OPTION_FASTOPEN : 0) |
+                            (arqOption != 0 ? OPTION_ARQ : 0);
+    char arqName[16];
+    arqOptionFormat(arqName, sizeof(arqName), arqOption);
+    if (fastOpen)
+        fillPool(&src, FALSE);
+    while (alarmCount < 3 && state == 0)
     {
-        
+        metricsPoll();
         if (alarmEnabled == FALSE)
             {
-            alarm(5); // Set alarm to be triggered in 3s
+            alarm(5); // Set alarm to be triggered in 5s
             alarmEnabled = TRUE;
         }
-        if (alarmCount == cycle && count != 0 && state == 1) {
+        if (alarmCount == cycle){
             cycle++;
-            if (connectionBad == 0){
-                clearBuffer(repeat);
-                clearBuffer(buf);
-                infoTrama(buf);
-                int numOfBytes = 3;
-                //printf("count - %i\n", count);
-                u_int8_t bcc = 0x00;
-                while (count > 0 && numOfBytes < 496 && connectionBad != 1){
-                    pread(file, buffer, next_block_size(count, 1), (info.st_size - count));
-                    //printf("count - %i\n",count);
-                    count --;
-                    numOfBytes ++;
-                    //printf("%d  - %i", buffer[0], numOfBytes);
-                    bcc = bcc ^ buffer[0];
-                    if (buffer[0] == 0x7e){
-                        buf[numOfBytes] = 0x7d;
-                        numOfBytes++;
-                        buf[numOfBytes] = 0x5e;
-                    }
-                    else if (buffer[0] == 0x7d){
-                        buf[numOfBytes] = 0x7d;
-                        numOfBytes++;
-                        buf[numOfBytes] = 0x5d;
-                    }
-                    else{
-                        buf[numOfBytes] = buffer[0];
-                    }
-                    //printf("byte - %d\n",buf[numOfBytes]);
-                }
-                if (buffer[numOfBytes + 1] == 0x7e){
-                        buf[numOfBytes + 1] = 0x7d;
-                        numOfBytes++;
-                        buf[numOfBytes + 1] = 0x5e;
-                    }
-                else if (buffer[numOfBytes + 1] == 0x7d){
-                        buf[numOfBytes + 1] = 0x7d;
-                        numOfBytes++;
-                        buf[numOfBytes + 1] = 0x5d;
-                    }
-                else{
-                    buf[numOfBytes + 1] = bcc;
+            sendSet(control, options, arqOption);
+            if (fastOpen){
+                arqSenderRewind(&arq);
+                sendWindow();
+            }
+            if (waitFor(&reader, &reply, FRAME_UA, FRAME_DISC, 3000)){
+                if (reply.type == FRAME_DISC){
+                    printf("Receiver refused the SET: its DATALINK_ARQ differs from this end's %s\n", arqName);
+                    exit(-1);
                 }
-                buf[numOfBytes + 2] = FLAG;
-                write(fd, buf, 500);
+                printf("Connection good ");
+                state++;
+            }
+        }
+    }
+    alarm(0);
+    if (state == 0){
+    	printf("Timed out!!!");
+    	exit(-1);
+    }
 
-                for (int k = 0; k<500; k++){
-                    printf("%c", buf[k]);
-                    repeat[k] = buf[k];
-                }
+    // The UA echoes the options the receiver agreed to, and its ARQ. One
+    // that did not look at ours would take every frame for the wrong one.
+    unsigned char agreed = reply.bccOk && reply.length >= 1 ? reply.payload[0] : 0;
+    unsigned char theirArq = (agreed & OPTION_ARQ) && reply.length >= 2 ? reply.payload[1] : 0;
+    if (theirArq != arqOption){
+        char theirName[16];
+        arqOptionFormat(theirName, sizeof(theirName), theirArq);
+        printf("\nReceiver runs DATALINK_ARQ=%s, this end %s\n", theirName, arqName);
+        exit(-1);
+    }
+    if (framing != FRAMING_HDLC){
+        if (agreed & framing){
+            frameSetFraming(framing);
+            reader.parser.framing = framing;
+            printf("\nFraming: cobs\n");
+        }
+        else
+            printf("\nReceiver did not agree to COBS, byte stuffing\n");
+    }
+    if (receiveName != NULL){
+        duplexMode = (agreed & OPTION_DUPLEX) != 0;
+        printf(duplexMode ? "\nReceiving %s back\n" : "\nReceiver has nothing to send back for %s\n", receiveName);
+    }
 
-                clearBuffer(buf);
+    // A receiver that did not echo fast open may not have looked at them
+    if (fastOpen && (agreed & OPTION_FASTOPEN))
+        printf("\nFast open, %lld frames went with the SET\n", arq.next - arq.base);
+    else if (fastOpen){
+        printf("\nReceiver did not agree to fast open, sending again\n");
+        arqSenderRewind(&arq);
+    }
+
+    // Transfer: the ARQ state machine decides what goes on the wire, this
+    // loop only moves frames and replies and feeds it the time
+    long long heardAt = metricsNow();
+    while (!arq.failed)
+    {
+        metricsPoll();
+        if (duplexMode)
+            reader.parser.skip = arqReceiverUnwanted(&reverse.arq);
+        if (arqSenderIdle(&arq) && !frameReady(arq.next)){
+            if (endQueued && encoderPending(&encoder) == 0 && (!duplexMode || reverse.done))
+                break;
+            // Nothing is in flight, so waiting on a quiet input is not a link
+            // timeout. With --receive the loop must keep serving the other
+            // direction instead.
+            if (!duplexMode){
+                fillPool(&src, TRUE);
+                continue;
             }
-            else
-            {
+            if (metricsNow() - heardAt > RETRANSMIT_TIMEOUT_MS * (MAX_RETRIES + 1) * 1000000LL){
+                printf("\nReceiver went quiet before its file ended");
+                break;
+            }
+        }
 
-                for(int i=0; i < 500; i++)
-                    printf("%c", repeat[i]);
-                write(fd, repeat, 500);
+        sendWindow();
+
+        // Prepare the upcoming frames while these wait for their RR
+        fillPool(&src, FALSE);
+
+        long long left = (arq.deadline - metricsNow()) / 1000000;
+        if (arq.deadline == 0)
+            left = DUPLEX_POLL_MS;
+        if (readFrameTimeout(&reader, &reply, left > 0 ? left : 0)){
+            long long now = metricsNow();
+            long long acked = arq.base;
+            heardAt = now;
+            linkProbe3(reply_received, reply.type, reply.seq, now);
+            if (reply.type == FRAME_I && duplexMode){
+                // Its N(R) is an RR for our frames
+                if (reply.nr >= 0)
+                    arqSenderAck(&arq, reply.nr, now);
+                receiveReverse(control, &reply, receiveName);
             }
-            
-            /*for(int i=0; i < 12; i++)
-                printf("%d -", buf[i]);*/
-            printf("\n Ns = %d Nr = %d \n",Ns, Nr);
-            //printf("here\n");
-            sleep(1);
-            if (readByByte(buf,fd)){
-                printf("\nGOOD READ\n");
-                for(int i=0; i < 5; i++)
-                    printf("%d -", buf[i]);
-
-                if (checkSupervision(buf, 500, C_RR_NR0) == 1){
-                    printf("Connection good for now");
-                    alarmCount = 0;
-                    cycle = 0;
-                    swap();
-                }
-                else if (checkSupervision(buf, 500, C_RR_NR0) == 2){
-                    printf("Message repeated");
-                    alarmCount = 0;
-                    cycle = 0;
-                    count = count + 497;
-                    swap();
-                }
-                else if (checkSupervision(buf, 500, C_REJ_NR0)){
-                    printf("Message rejected by transmitter");
-                    cycle++;
-                    count = count + 497;
-                }
-                else {
-                    printf("Radom Message");
-                    connectionBad = 1;
-                    continue;
-                }
-                connectionBad = 0;
+            else if (reply.type == FRAME_RR){
+                if (verbose)
+                    printf("\nGOOD READ %s%d\n", frameTypeName(reply.type), reply.seq);
+                arqSenderAck(&arq, reply.seq, now);
+                // A credit byte narrows the window, none opens all of it
+                if (reply.length == 0)
+                    arqSenderCredit(&arq, arq.config.window, now);
+                else if (reply.bccOk)
+                    arqSenderCredit(&arq, reply.payload[0], now);
             }
-            else {
-                printf("\nBAD READ\n");
-                connectionBad = 1;
-                continue;
+            else if (reply.type == FRAME_RNR){
+                // Nothing goes until an RR, and waiting is not a retry
+                printf("\nReceiver not ready, RNR%d\n", reply.seq);
+                metricAdd(notReady, 1);
+                arqSenderAck(&arq, reply.seq, now);
+                arqSenderCredit(&arq, 0, now);
+            }
+            else if (reply.type == FRAME_REJ){
+                // Resent right away, no need to wait for the timer
+                printf("Message rejected by transmitter");
+                metricAdd(framesRejected, 1);
+                arqSenderReject(&arq, reply.seq, now);
+            }
+            else if (reply.type == FRAME_SREJ){
+                // Only the frame named goes again
+                printf("Message %d rejected by transmitter", reply.seq);
+                metricAdd(framesRejected, 1);
+                arqSenderSelectiveReject(&arq, reply.seq, now);
+            }
+            else
+                printf("Ignoring %s frame\n", frameTypeName(reply.type));
+            for (; acked < arq.base; acked++){
+                histogramRecord(&metrics.ackLatency, now - sentAt[acked % FRAME_POOL_SIZE]);
+                linkProbe3(frame_acked, acked, sentAt[acked % FRAME_POOL_SIZE], now);
+                advanceHead();
             }
-            /*for(int i=0; i < 500; i++)
-                    printf("%i -- %c\n",i, buf[i]);
-                printf("\n");*/
-            
-        }
-        if (alarmCount == cycle && state == 0){
-            clearBuffer(buf);
-            /*bytes = read(fd, buf, 500);
-            for(int i=0; i < 5; i++)
-    	        printf("%d -", buf[i]);
-            if (checkSupervision(buf, 500, C_UA)){
-                alarmEnabled = FALSE;
-                break;
-            }*/
-            cycle++;
-            trama(FLAG,A_SET,C_SET,A_SET ^ C_SET,FLAG,buf);
-            write(fd, buf, 500);
-            clearBuffer(buf);
-            sleep(3);
-            if(readByByte(buf,fd))
-                if (checkSupervision(buf, 500, C_UA)){
-                    printf("Connection good ");
-                    state++;
-                    alarmCount = 0;
-                    cycle = 0;
-                }
-            
-            //printf("state - %i  cycle - %i  alarm - %i", state, cycle, alarmCount);
         }
-        if (count < 1){
-            while(disconnectReceiver == 0){
-                clearBuffer(buf);
-                trama(FLAG, A_SET,C_DISC, A_SET ^ C_DISC, FLAG, buf);
-                write(fd, buf, 500);
-                clearBuffer(buf);
-                sleep(1);
-                if(readByByte(buf,fd)){
-                    if(checkSupervision(buf, 500, C_DISC)){
-                        clearBuffer(buf);
-                        printf("\nDisconnection received");
-                        trama(FLAG, A_SET,C_UA, A_SET ^ C_UA, FLAG, buf);
-                        write(fd, buf, 500);
-                        disconnectReceiver = 1;
-                    }
+        else {
+            // One tick per pass: with no credit a timeout is a probe, not a loss
+            int probing = arq.credit == 0;
+            if (arqSenderTick(&arq, metricsNow())){
+                if (probing)
+                    printf("\nReceiver still not ready, probing\n");
+                else {
+                    printf("\nBAD READ\n");
+                    metricAdd(timeouts, 1);
+                    linkProbe2(timeout, arq.base, arq.retries);
                 }
             }
         }
     }
-    if (alarmCount == 3){
+    if (arq.failed){
     	printf("Timed out!!!");
     	exit(-1);
     }
-    close(file);
+
+    // Disconnection
+    while(disconnectReceiver == 0){
+        sendControl(control, C_DISC);
+        if (waitFor(&reader, &reply, FRAME_DISC, FRAME_DISC, 1000)){
+            printf("\nDisconnection received");
+            sendControl(control, C_UA);
+            disconnectReceiver = 1;
+        }
+    }
+    if (deltaMode){
+        printf("\n%lld bytes sent, %lld as data and %lld copied from the basis",
+               scan.size, deltaLiteral, deltaCopied);
+        if (scan.size > 0)
+            munmap((void*)scan.src, scan.size);
+        signatureFree(&sig);
+    }
+    else if (spoolMode){
+        // Spool frames do not record their payload, so it is accounted at the end
+        metricAdd(payloadBytesOut, spool.sourceSize);
+        printf("\n%lld bytes sent from %lld spooled frames", spool.sourceSize, spool.count);
+        spoolClose(&spool);
+    }
+    else
+        printf("\n%lld bytes sent", src.total);
+    if (duplexMode){
+        if (reverse.done && reverse.ok)
+            printf("\n%lld bytes received back into %s, file hash OK", reverse.received, receiveName);
+        else if (reverse.done)
+            printf("\n%lld bytes received back into %s, but the size or hash does not match", reverse.received, receiveName);
+        else
+            printf("\nOnly %lld bytes of %s arrived", reverse.received, receiveName);
+    }
+    if (encoder.workers > 0)
+        encoderStop(&encoder);
+    if (receiveName != NULL && !duplexReceiveClose(&reverse))
+        perror(receiveName);
+    sourceClose(&src);
+    frameRelease(control);
     printf("\n");
+    framePoolReport("sender");
+    metricsDump(stderr);
     
     // Wait until all bytes have been written to the serial port
-    sleep(1);
+    ioEngineClose(&io);
 
     // Restore the old port settings
     if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
@@ -390,76 +880,3 @@ int main(int argc, char *argv[])
     return 0;
 }
 
-
-int checkSupervision(unsigned char* buf, int length, u_int8_t ctrField){
-    int currentChar = 0;
-    int state = 0; // 0 = START, 1 = FLAG, 2 = ADDRESS, 3 = CONTROL, 4 = BCC, 5 = STOPFLAG
-    if (ctrField == C_RR_NR0 && Nr == 1)
-        ctrField = C_RR_NR1;
-    if (ctrField == C_REJ_NR0 && Nr == 1)
-        ctrField = C_REJ_NR1;
-
-
-    while(currentChar<length){
-        //printf("%d - ",buf[currentChar]);
-        unsigned char x = buf[currentChar];
-        int resend = 0;
-        switch(state){
-            case 0: 
-                if(buf[currentChar] == FLAG)
-                    state = 1;
-                
-                currentChar++;
-                break;
-            
-            case 1:
-                if(buf[currentChar] == A_RES)
-                    state = 2;
-                else if(buf[currentChar] != FLAG)
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 2:
-                if(buf[currentChar] == ctrField)
-                    state = 3;
-                else if(buf[currentChar] == (ctrField ^ 0x80)){
-                    resend = 1;
-                    state = 3;
-                }
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-                
-            case 3:
-                if(buf[currentChar] == buf[currentChar-1]^buf[currentChar-2])
-                    state = 4;
-                else if(buf[currentChar] == FLAG)
-                    state = 1;
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-            
-            case 4:
-                if(buf[currentChar] == FLAG){
-                    if (resend == 0)
-                        return 1; //Good frame with C_RR Nr byte equal to our Nr value. Can proceed
-                    else 
-                        return 2; //Received a confirmation for a frame that wasn't the one sent. Resending this one.
-                }
-                else 
-                    state = 0;
-                    
-                currentChar++;
-                break;
-        }
-    }
-    return 0; //Frame not good
-}